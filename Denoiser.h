@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "TileScheduler.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DENOISER_SSE
+#include <emmintrin.h>
+#endif
+
+// Edge avoiding a-trous wavelet filter, cf "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering",
+// Dammertz, Sewtz, Hanika, Lensch, 2010
+// The same 5x5 B3 spline kernel is applied levels times with holes, its taps are 1, 2, 4, ... pixels apart. The weight of a tap
+// is stopped by the differences of illumination, albedo, depth and normal with the center pixel. The illumination is the color
+// divided by the albedo, so the textures are not blurred, and multiplied back at the end.
+// The planes are padded by a border of empty pixels, their normal is null and their weight is 0 : there is no test on the bounds.
+
+const float DENOISE_MIN_ALBEDO = 0.01f;
+const float DENOISE_COLOR_SIGMA = 5.0f;		// illumination tolerance at the first level, relative to the mean illumination
+const float DENOISE_ALBEDO_SIGMA = 0.1f;
+const float DENOISE_DEPTH_SIGMA = 0.02f;	// depth tolerance per pixel of distance, relative to the depth of the center
+const int DENOISE_NORMAL_POWER = 128;		// weight of the normals, dot(np, nq)^128
+
+class Denoiser
+{
+public:
+	Denoiser(const int width, const int height, const int levels)
+		: m_width(width), m_height(height), m_levels(std::min(std::max(levels, 1), 5)),
+		m_border(1 << m_levels), m_stride((width + 2 * m_border + 3) & ~3), m_rows(height + 2 * m_border)
+	{
+		// the last group of 4 pixels of the last row can read 3 values past the end
+		size_t size = (size_t)m_stride * m_rows + 4;
+		for (int k = 0; k < 3; k++)
+		{
+			m_color[k].assign(size, 0.0f);
+			m_filtered[k].assign(size, 0.0f);
+			m_albedo[k].assign(size, 0.0f);
+			m_normal[k].assign(size, 0.0f);
+		}
+		m_depth.assign(size, 0.0f);
+	}
+
+	int levels() const { return m_levels; }
+
+	//! renseigne les buffers auxiliaires d'un pixel touche par un rayon primaire, la normale est unitaire.
+	void guides(const int x, const int y, const float albedo[3], const float normal[3], const float depth)
+	{
+		size_t i = index(x, y);
+		for (int k = 0; k < 3; k++)
+		{
+			m_albedo[k][i] = albedo[k];
+			m_normal[k][i] = normal[k];
+		}
+		m_depth[i] = depth;
+	}
+
+	//! renseigne la couleur bruitee d'un pixel, apres guides().
+	void color(const int x, const int y, const float rgb[3])
+	{
+		size_t i = index(x, y);
+		for (int k = 0; k < 3; k++)
+			m_color[k][i] = rgb[k] / std::max(m_albedo[k][i], DENOISE_MIN_ALBEDO);
+	}
+
+	//! renvoie la couleur filtree d'un pixel, apres run().
+	void result(const int x, const int y, float rgb[3]) const
+	{
+		size_t i = index(x, y);
+		for (int k = 0; k < 3; k++)
+			rgb[k] = m_color[k][i] * std::max(m_albedo[k][i], DENOISE_MIN_ALBEDO);
+	}
+
+	/*! filtre l'image sur les threads du pool. strength multiplie la tolerance sur les differences d'eclairement,
+		1 par defaut, plus grand lisse plus, plus petit conserve plus de details.
+	*/
+	void run(ThreadPool& pool, const float strength)
+	{
+		// the illumination tolerance is relative to the mean illumination of the pixels with a normal
+		double sum = 0.0;
+		long count = 0;
+		for (int y = 0; y < m_height; y++)
+			for (int x = 0; x < m_width; x++)
+			{
+				size_t i = index(x, y);
+				if (m_normal[0][i] == 0 && m_normal[1][i] == 0 && m_normal[2][i] == 0)
+					continue;
+				sum += (m_color[0][i] + m_color[1][i] + m_color[2][i]) / 3;
+				count++;
+			}
+		float mean = count > 0 ? (float)(sum / count) : 1.0f;
+		float sigmaColor = std::max(strength * DENOISE_COLOR_SIGMA * mean, 1e-6f);
+
+		for (int level = 0; level < m_levels; level++)
+		{
+			// the tolerance on the illumination is halved at each level, the noise was already reduced by the previous ones
+			Level parameters;
+			parameters.step = 1 << level;
+			parameters.invSigmaColor = (float)(1 << (2 * level)) / (sigmaColor * sigmaColor);
+			parameters.invSigmaAlbedo = 1.0f / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA);
+			parameters.invSigmaDepth = 1.0f / DENOISE_DEPTH_SIGMA;
+
+			std::atomic<int> next(0);
+			pool.run([&](const int thread)
+			{
+				int y;
+				while ((y = next.fetch_add(1)) < m_height)
+					filter_row(parameters, y + m_border);
+			});
+			for (int k = 0; k < 3; k++)
+				m_color[k].swap(m_filtered[k]);
+		}
+	}
+
+protected:
+	struct Level
+	{
+		int step;
+		float invSigmaColor;
+		float invSigmaAlbedo;
+		float invSigmaDepth;
+	};
+
+	size_t index(const int x, const int y) const
+	{
+		return (size_t)(y + m_border) * m_stride + x + m_border;
+	}
+
+	void filter_row(const Level& level, const int y)
+	{
+		static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+		int x = m_border;
+#ifdef DENOISER_SSE
+		// 4 pixels at a time, the stride is a multiple of 4 and the border is wider than the kernel
+		for (; x < m_border + m_width; x += 4)
+		{
+			size_t p = (size_t)y * m_stride + x;
+			__m128 cr = _mm_loadu_ps(&m_color[0][p]), cg = _mm_loadu_ps(&m_color[1][p]), cb = _mm_loadu_ps(&m_color[2][p]);
+			__m128 ar = _mm_loadu_ps(&m_albedo[0][p]), ag = _mm_loadu_ps(&m_albedo[1][p]), ab = _mm_loadu_ps(&m_albedo[2][p]);
+			__m128 nx = _mm_loadu_ps(&m_normal[0][p]), ny = _mm_loadu_ps(&m_normal[1][p]), nz = _mm_loadu_ps(&m_normal[2][p]);
+			__m128 z = _mm_loadu_ps(&m_depth[p]);
+			__m128 invZ = _mm_div_ps(_mm_set1_ps(level.invSigmaDepth / level.step), _mm_max_ps(z, _mm_set1_ps(1e-6f)));
+			__m128 zero = _mm_setzero_ps();
+			__m128 sr = zero, sg = zero, sb = zero, sw = zero;
+			for (int dy = -2; dy <= 2; dy++)
+			{
+				for (int dx = -2; dx <= 2; dx++)
+				{
+					size_t q = p + (ptrdiff_t)dy * level.step * m_stride + dx * level.step;
+					float inverseDistance = (dx || dy) ? 1.0f / std::max(std::abs(dx), std::abs(dy)) : 0.0f;
+					__m128 qr = _mm_loadu_ps(&m_color[0][q]), qg = _mm_loadu_ps(&m_color[1][q]), qb = _mm_loadu_ps(&m_color[2][q]);
+					__m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(&m_normal[0][q])), _mm_mul_ps(ny, _mm_loadu_ps(&m_normal[1][q]))), _mm_mul_ps(nz, _mm_loadu_ps(&m_normal[2][q])));
+					__m128 wn = _mm_max_ps(dot, zero);
+					for (int k = 1; k < DENOISE_NORMAL_POWER; k *= 2)
+						wn = _mm_mul_ps(wn, wn);
+
+					__m128 dr = _mm_sub_ps(cr, qr), dg = _mm_sub_ps(cg, qg), db = _mm_sub_ps(cb, qb);
+					__m128 dc = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+					__m128 er = _mm_sub_ps(ar, _mm_loadu_ps(&m_albedo[0][q])), eg = _mm_sub_ps(ag, _mm_loadu_ps(&m_albedo[1][q])), eb = _mm_sub_ps(ab, _mm_loadu_ps(&m_albedo[2][q]));
+					__m128 da = _mm_add_ps(_mm_add_ps(_mm_mul_ps(er, er), _mm_mul_ps(eg, eg)), _mm_mul_ps(eb, eb));
+					__m128 dz = _mm_sub_ps(z, _mm_loadu_ps(&m_depth[q]));
+					dz = _mm_max_ps(dz, _mm_sub_ps(zero, dz));
+
+					__m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dc, _mm_set1_ps(level.invSigmaColor)), _mm_mul_ps(da, _mm_set1_ps(level.invSigmaAlbedo))),
+						_mm_mul_ps(dz, _mm_mul_ps(invZ, _mm_set1_ps(inverseDistance))));
+					__m128 w = _mm_mul_ps(_mm_mul_ps(wn, exp_negative(_mm_sub_ps(zero, e))), _mm_set1_ps(kernel[dy + 2] * kernel[dx + 2]));
+					sr = _mm_add_ps(sr, _mm_mul_ps(w, qr));
+					sg = _mm_add_ps(sg, _mm_mul_ps(w, qg));
+					sb = _mm_add_ps(sb, _mm_mul_ps(w, qb));
+					sw = _mm_add_ps(sw, w);
+				}
+			}
+
+			// the pixels without weight, without hit or in the border, keep their value
+			__m128 valid = _mm_cmpgt_ps(sw, zero);
+			__m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(sw, _mm_set1_ps(1e-30f)));
+			_mm_storeu_ps(&m_filtered[0][p], _mm_or_ps(_mm_and_ps(valid, _mm_mul_ps(sr, inv)), _mm_andnot_ps(valid, cr)));
+			_mm_storeu_ps(&m_filtered[1][p], _mm_or_ps(_mm_and_ps(valid, _mm_mul_ps(sg, inv)), _mm_andnot_ps(valid, cg)));
+			_mm_storeu_ps(&m_filtered[2][p], _mm_or_ps(_mm_and_ps(valid, _mm_mul_ps(sb, inv)), _mm_andnot_ps(valid, cb)));
+		}
+#else
+		for (; x < m_border + m_width; x++)
+		{
+			size_t p = (size_t)y * m_stride + x;
+			float invZ = level.invSigmaDepth / level.step / std::max(m_depth[p], 1e-6f);
+			float sum[3] = { 0, 0, 0 };
+			float sw = 0;
+			for (int dy = -2; dy <= 2; dy++)
+			{
+				for (int dx = -2; dx <= 2; dx++)
+				{
+					size_t q = p + (ptrdiff_t)dy * level.step * m_stride + dx * level.step;
+					float dot = m_normal[0][p] * m_normal[0][q] + m_normal[1][p] * m_normal[1][q] + m_normal[2][p] * m_normal[2][q];
+					float wn = std::max(dot, 0.0f);
+					for (int k = 1; k < DENOISE_NORMAL_POWER; k *= 2)
+						wn = wn * wn;
+
+					float dc = 0, da = 0;
+					for (int k = 0; k < 3; k++)
+					{
+						dc += (m_color[k][p] - m_color[k][q]) * (m_color[k][p] - m_color[k][q]);
+						da += (m_albedo[k][p] - m_albedo[k][q]) * (m_albedo[k][p] - m_albedo[k][q]);
+					}
+					float dz = std::abs(m_depth[p] - m_depth[q]);
+					float distance = (float)std::max(std::abs(dx), std::abs(dy));
+
+					float e = dc * level.invSigmaColor + da * level.invSigmaAlbedo + (distance > 0 ? dz * invZ / distance : 0.0f);
+					float w = wn * std::exp(-e) * kernel[dy + 2] * kernel[dx + 2];
+					for (int k = 0; k < 3; k++)
+						sum[k] += w * m_color[k][q];
+					sw += w;
+				}
+			}
+
+			for (int k = 0; k < 3; k++)
+				m_filtered[k][p] = sw > 0 ? sum[k] / sw : m_color[k][p];
+		}
+#endif
+	}
+
+#ifdef DENOISER_SSE
+	// exp(x) for x <= 0 : 2^i * 2^f, with a polynomial for 2^f, f in [0 1[
+	static __m128 exp_negative(__m128 x)
+	{
+		x = _mm_max_ps(x, _mm_set1_ps(-80.0f));
+		__m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+		__m128i i = _mm_cvttps_epi32(t);
+		__m128 fi = _mm_cvtepi32_ps(i);
+		// truncation rounds the negative values up, floor() is one less
+		__m128 greater = _mm_cmpgt_ps(fi, t);
+		fi = _mm_sub_ps(fi, _mm_and_ps(greater, _mm_set1_ps(1.0f)));
+		i = _mm_cvttps_epi32(fi);
+		__m128 f = _mm_sub_ps(t, fi);
+		__m128 p = _mm_set1_ps(0.0096181f);
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0555041f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.2402265f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.6931472f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+		__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+		return _mm_mul_ps(p, scale);
+	}
+#endif
+
+	int m_width, m_height;
+	int m_levels;
+	int m_border;
+	int m_stride, m_rows;
+	std::vector<float> m_color[3];
+	std::vector<float> m_filtered[3];
+	std::vector<float> m_albedo[3];
+	std::vector<float> m_normal[3];
+	std::vector<float> m_depth;
+};
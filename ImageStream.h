@@ -0,0 +1,323 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Images written while they are rendered, used by ray_tuto for the images that do not fit in memory.
+// The rows are given by bands, from the top of the image to the bottom, a thread of the stream encodes them while the
+// next bands are rendered. Only the bands waiting for the encoder are in memory, push() waits when there are too many.
+// The hdr file uses the run length encoded scanlines of the Radiance format, cf "Graphics Gems II", Ward, the png file
+// uses stored deflate blocks : the rows are not compressed, but the file is written as the rows arrive. The png of a large
+// render is about 3 bytes per pixel, 800MB for 16K x 16K pixels : the hdr file is the output of the large renders, the
+// png is a preview for the smaller ones.
+// The 8 bits colors of the png are the same as write_image() : the floats are clamped to [0 1] and multiplied by 255.
+
+class ImageStream
+{
+public:
+	//! ouvre les fichiers de l'image, hdrFile ou pngFile peut etre null. pending est le nombre max de bandes en attente.
+	ImageStream(const char *hdrFile, const char *pngFile, const int width, const int height, const int pending = 2)
+		: m_width(width), m_height(height), m_pending(std::max(pending, 1))
+	{
+		if (hdrFile)
+			m_hdr = fopen(hdrFile, "wb");
+		if (pngFile)
+			m_png = fopen(pngFile, "wb");
+		if ((hdrFile && m_hdr == nullptr) || (pngFile && m_png == nullptr))
+		{
+			printf("[error] opening '%s'...\n", (hdrFile && m_hdr == nullptr) ? hdrFile : pngFile);
+			m_error = true;
+			return;	// pas d'encodeur, is_open() renvoie false
+		}
+
+		if (m_hdr)
+			fprintf(m_hdr, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", m_height, m_width);
+		if (m_png)
+			write_png_header();
+		m_thread = std::thread(&ImageStream::encoder, this);
+	}
+
+	~ImageStream() { close(); }
+
+	//! renvoie false si un fichier n'a pas pu etre ouvert, l'image ne doit pas etre rendue.
+	bool is_open() const { return m_error == false; }
+
+	//! ajoute les lignes suivantes de l'image, width x rows pixels rgb, de haut en bas.
+	void push(std::vector<float>&& rows)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_space.wait(lock, [this]() { return (int)m_bands.size() < m_pending; });
+		m_bands.push_back(std::move(rows));
+		m_ready.notify_one();
+	}
+
+	//! attend l'encodage des dernieres lignes et ferme les fichiers, renvoie false si une ecriture a echoue.
+	bool close()
+	{
+		if (m_thread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_closing = true;
+			}
+			m_ready.notify_one();
+			m_thread.join();
+
+			if (m_rows != m_height)
+			{
+				printf("[error] image stream: %d rows written, %d expected\n", m_rows, m_height);
+				m_error = true;
+			}
+			if (m_png)
+				write_png_end();
+		}
+
+		if (m_hdr && fclose(m_hdr) != 0)
+			m_error = true;
+		if (m_png && fclose(m_png) != 0)
+			m_error = true;
+		m_hdr = nullptr;
+		m_png = nullptr;
+		return m_error == false;
+	}
+
+protected:
+	void encoder()
+	{
+		std::vector<unsigned char> hdr, png;
+		while (true)
+		{
+			std::vector<float> rows;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_ready.wait(lock, [this]() { return m_closing || m_bands.empty() == false; });
+				if (m_bands.empty())
+					return;
+				rows = std::move(m_bands.front());
+				m_bands.pop_front();
+			}
+			m_space.notify_one();
+
+			int count = (int)(rows.size() / (3 * m_width));
+			hdr.clear();
+			png.clear();
+			for (int y = 0; y < count; y++)
+			{
+				const float *row = rows.data() + (size_t)y * 3 * m_width;
+				if (m_hdr)
+					encode_rgbe(row, hdr);
+				if (m_png)
+				{
+					png.push_back(0);	// no filter
+					for (int i = 0; i < 3 * m_width; i++)
+						png.push_back((unsigned char)(std::min(std::max(row[i], 0.0f), 1.0f) * 255.0f));
+				}
+			}
+			m_rows += count;
+
+			if (m_hdr && fwrite(hdr.data(), 1, hdr.size(), m_hdr) != hdr.size())
+				m_error = true;
+			if (m_png)
+				write_png_data(png, false);
+		}
+	}
+
+	// Radiance scanline : flat when the width can not be encoded, otherwise the 4 components are run length encoded
+	void encode_rgbe(const float *row, std::vector<unsigned char>& out)
+	{
+		std::vector<unsigned char> rgbe(4 * m_width);
+		for (int x = 0; x < m_width; x++)
+		{
+			float r = row[3 * x], g = row[3 * x + 1], b = row[3 * x + 2];
+			float v = std::max(r, std::max(g, b));
+			if (v < 1e-32f)
+			{
+				rgbe[4 * x] = rgbe[4 * x + 1] = rgbe[4 * x + 2] = rgbe[4 * x + 3] = 0;
+				continue;
+			}
+			int e;
+			float scale = std::frexp(v, &e) * 256.0f / v;
+			rgbe[4 * x] = (unsigned char)(std::max(r, 0.0f) * scale);
+			rgbe[4 * x + 1] = (unsigned char)(std::max(g, 0.0f) * scale);
+			rgbe[4 * x + 2] = (unsigned char)(std::max(b, 0.0f) * scale);
+			rgbe[4 * x + 3] = (unsigned char)(e + 128);
+		}
+
+		if (m_width < 8 || m_width > 0x7fff)
+		{
+			out.insert(out.end(), rgbe.begin(), rgbe.end());
+			return;
+		}
+
+		out.push_back(2);
+		out.push_back(2);
+		out.push_back((unsigned char)(m_width >> 8));
+		out.push_back((unsigned char)(m_width & 0xff));
+		std::vector<unsigned char> component(m_width);
+		for (int c = 0; c < 4; c++)
+		{
+			for (int x = 0; x < m_width; x++)
+				component[x] = rgbe[4 * x + c];
+			encode_runs(component, out);
+		}
+	}
+
+	// runs of at least 4 equal bytes, up to 127, the other bytes are copied by groups of up to 128
+	static void encode_runs(const std::vector<unsigned char>& data, std::vector<unsigned char>& out)
+	{
+		const int n = (int)data.size();
+		int literal = 0;
+		for (int i = 0; i < n;)
+		{
+			int run = 1;
+			while (i + run < n && run < 127 && data[i + run] == data[i])
+				run++;
+
+			if (run >= 4)
+			{
+				flush_literals(data, i - literal, literal, out);
+				literal = 0;
+				out.push_back((unsigned char)(128 + run));
+				out.push_back(data[i]);
+				i += run;
+			}
+			else
+			{
+				literal++;
+				i++;
+			}
+		}
+		flush_literals(data, n - literal, literal, out);
+	}
+
+	static void flush_literals(const std::vector<unsigned char>& data, int first, int count, std::vector<unsigned char>& out)
+	{
+		while (count > 0)
+		{
+			int n = std::min(count, 128);
+			out.push_back((unsigned char)n);
+			out.insert(out.end(), data.begin() + first, data.begin() + first + n);
+			first += n;
+			count -= n;
+		}
+	}
+
+	// png : signature, IHDR, then IDAT chunks holding a zlib stream of stored deflate blocks, cf RFC 1950 and 1951
+	void write_png_header()
+	{
+		static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		fwrite(signature, 1, 8, m_png);
+
+		std::vector<unsigned char> ihdr;
+		put32(ihdr, (uint32_t)m_width);
+		put32(ihdr, (uint32_t)m_height);
+		ihdr.push_back(8);	// bits per component
+		ihdr.push_back(2);	// rgb
+		ihdr.push_back(0);
+		ihdr.push_back(0);
+		ihdr.push_back(0);
+		write_chunk("IHDR", ihdr);
+
+		// zlib header : deflate, 32K window, no dictionary
+		std::vector<unsigned char> zlib = { 0x78, 0x01 };
+		write_chunk("IDAT", zlib);
+	}
+
+	void write_png_data(const std::vector<unsigned char>& data, const bool last)
+	{
+		std::vector<unsigned char> idat;
+		size_t offset = 0;
+		do
+		{
+			size_t length = std::min(data.size() - offset, (size_t)65535);
+			bool final = last && offset + length == data.size();
+			idat.push_back(final ? 1 : 0);
+			idat.push_back((unsigned char)(length & 0xff));
+			idat.push_back((unsigned char)(length >> 8));
+			idat.push_back((unsigned char)(~length & 0xff));
+			idat.push_back((unsigned char)((~length >> 8) & 0xff));
+			idat.insert(idat.end(), data.begin() + offset, data.begin() + offset + length);
+			offset += length;
+		}
+		while (offset < data.size());
+
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			m_adlerA = (m_adlerA + data[i]) % 65521;
+			m_adlerB = (m_adlerB + m_adlerA) % 65521;
+		}
+		if (last)
+			put32(idat, (m_adlerB << 16) | m_adlerA);
+		write_chunk("IDAT", idat);
+	}
+
+	void write_png_end()
+	{
+		write_png_data(std::vector<unsigned char>(), true);
+		write_chunk("IEND", std::vector<unsigned char>());
+	}
+
+	void write_chunk(const char *type, const std::vector<unsigned char>& data)
+	{
+		std::vector<unsigned char> chunk;
+		put32(chunk, (uint32_t)data.size());
+		chunk.insert(chunk.end(), type, type + 4);
+		chunk.insert(chunk.end(), data.begin(), data.end());
+		put32(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+		if (fwrite(chunk.data(), 1, chunk.size(), m_png) != chunk.size())
+			m_error = true;
+	}
+
+	static void put32(std::vector<unsigned char>& out, const uint32_t v)
+	{
+		out.push_back((unsigned char)(v >> 24));
+		out.push_back((unsigned char)(v >> 16));
+		out.push_back((unsigned char)(v >> 8));
+		out.push_back((unsigned char)v);
+	}
+
+	static uint32_t crc32(const unsigned char *data, const size_t size)
+	{
+		static uint32_t table[256] = {};
+		static std::once_flag once;
+		std::call_once(once, []()
+		{
+			for (uint32_t n = 0; n < 256; n++)
+			{
+				uint32_t c = n;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				table[n] = c;
+			}
+		});
+
+		uint32_t crc = 0xffffffffu;
+		for (size_t i = 0; i < size; i++)
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return crc ^ 0xffffffffu;
+	}
+
+	int m_width;
+	int m_height;
+	int m_pending;
+	int m_rows = 0;
+	FILE *m_hdr = nullptr;
+	FILE *m_png = nullptr;
+	bool m_error = false;
+	uint32_t m_adlerA = 1;
+	uint32_t m_adlerB = 0;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_ready;
+	std::condition_variable m_space;
+	std::deque<std::vector<float>> m_bands;
+	bool m_closing = false;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+// Samplers used by ray_tuto : every pixel owns its generator, seeded from its coordinates,
+// so the result does not depend on the number of threads or on the order the pixels are rendered.
+
+enum SamplerType { SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_R2 };
+
+// PCG32 random number generator, cf http://www.pcg-random.org
+struct PCG32
+{
+	uint64_t state;
+	uint64_t inc;
+
+	PCG32(const uint64_t seed = 0x853c49e6748fea9bULL, const uint64_t sequence = 0xda3e39cb94b95bdbULL)
+	{
+		state = 0;
+		inc = (sequence << 1u) | 1u;
+		next();
+		state += seed;
+		next();
+	}
+
+	uint32_t next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = (uint32_t)(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+	}
+
+	//! renvoie un reel uniforme dans [0 1[.
+	float uniform()
+	{
+		// 24 bits, the float is always < 1
+		return (next() >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+// Hash of the pixel coordinates and of the render seed, cf "Hash Functions for GPU Rendering", Jarzynski & Olano
+inline uint32_t hash_pixel(const uint32_t x, const uint32_t y, const uint32_t seed)
+{
+	uint32_t v[3] = { x, y, seed };
+	for (int i = 0; i < 3; i++)
+	{
+		uint32_t h = v[i] * 747796405u + 2891336453u;
+		h = ((h >> ((h >> 28u) + 4u)) ^ h) * 277803737u;
+		v[(i + 1) % 3] ^= (h >> 22u) ^ h;
+	}
+	return v[0] ^ v[1] ^ v[2];
+}
+
+// 2D sequences of samples in [0 1[ x [0 1[ for one pixel
+class Sampler
+{
+public:
+	Sampler(const SamplerType type, const int x, const int y, const uint32_t seed)
+		: m_type(type), m_rng(hash_pixel(x, y, seed), hash_pixel(y, x, ~seed))
+	{
+		// per pixel decorrelation : random digital shift for Sobol, toroidal shift for R2
+		m_scramble[0] = m_rng.next();
+		m_scramble[1] = m_rng.next();
+		m_shift[0] = m_rng.uniform();
+		m_shift[1] = m_rng.uniform();
+	}
+
+	SamplerType type() const { return m_type; }
+
+	//! renvoie un reel uniforme dans [0 1[, independant de l'indice de l'echantillon.
+	float uniform() { return m_rng.uniform(); }
+
+	//! renvoie l'echantillon 2d d'indice i de la sequence du pixel.
+	void sample2D(const uint32_t i, float& u, float& v)
+	{
+		if (m_type == SAMPLER_SOBOL)
+		{
+			u = to_float(van_der_corput(i) ^ m_scramble[0]);
+			v = to_float(sobol(i) ^ m_scramble[1]);
+		}
+		else if (m_type == SAMPLER_R2)
+		{
+			// generalized golden ratio sequence, cf "The Unreasonable Effectiveness of Quasirandom Sequences", Roberts
+			const double g = 1.32471795724474602596;
+			u = fract(0.5 + i / g + m_shift[0]);
+			v = fract(0.5 + i / (g * g) + m_shift[1]);
+		}
+		else
+		{
+			u = m_rng.uniform();
+			v = m_rng.uniform();
+		}
+	}
+
+protected:
+	// first 2 dimensions of the Sobol sequence
+	static uint32_t van_der_corput(uint32_t i)
+	{
+		uint32_t r = 0;
+		for (uint32_t v = 1u << 31; i; i >>= 1, v >>= 1)
+			if (i & 1)
+				r ^= v;
+		return r;
+	}
+	static uint32_t sobol(uint32_t i)
+	{
+		uint32_t r = 0;
+		for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+			if (i & 1)
+				r ^= v;
+		return r;
+	}
+
+	static float to_float(const uint32_t bits)
+	{
+		return (bits >> 8) * (1.0f / 16777216.0f);
+	}
+	// the fractional part rounded to a float, clamped to the largest float < 1 : the values just below 1 round to 1
+	static float fract(const double x)
+	{
+		return std::min((float)(x - std::floor(x)), 1.0f - 1.0f / 16777216.0f);
+	}
+
+	SamplerType m_type;
+	PCG32 m_rng;
+	uint32_t m_scramble[2];
+	float m_shift[2];
+};
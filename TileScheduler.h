@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tile scheduler used by ray_tuto : the image is cut in square tiles, each thread owns a queue of neighbour tiles and
+// steals tiles at the end of the queues of the other threads when its own queue is empty.
+// The threads of the pool are created once and reused by every render and every pass.
+
+enum TileOrder { ORDER_SCANLINE, ORDER_MORTON, ORDER_HILBERT };
+
+struct Tile
+{
+	int x, y;
+	int width, height;
+};
+
+// Persistent threads, run() executes the same job on every thread and waits for the end
+class ThreadPool
+{
+public:
+	explicit ThreadPool(const int count = 0)
+	{
+		int n = count > 0 ? count : (int)std::thread::hardware_concurrency();
+		n = std::max(n, 1);
+		for (int i = 0; i < n; i++)
+			m_threads.push_back(std::thread(&ThreadPool::worker, this, i));
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_start.notify_all();
+		for (size_t i = 0; i < m_threads.size(); i++)
+			m_threads[i].join();
+	}
+
+	int size() const { return (int)m_threads.size(); }
+
+	//! execute job(thread) sur chaque thread du pool, et attend qu'ils aient tous termine.
+	void run(const std::function<void(const int)>& job)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_job = job;
+		m_running = size();
+		m_generation++;
+		m_start.notify_all();
+		m_done.wait(lock, [this]() { return m_running == 0; });
+		m_job = nullptr;
+	}
+
+protected:
+	void worker(const int id)
+	{
+		unsigned int generation = 0;
+		while (true)
+		{
+			std::function<void(const int)> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_start.wait(lock, [&]() { return m_stop || m_generation != generation; });
+				if (m_stop)
+					return;
+				generation = m_generation;
+				job = m_job;
+			}
+
+			job(id);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_running == 0)
+				m_done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+	std::function<void(const int)> m_job;
+	unsigned int m_generation = 0;
+	int m_running = 0;
+	bool m_stop = false;
+};
+
+// Position of the i-th cell of a n x n grid along a curve, n is a power of 2
+inline void curve_cell(const TileOrder order, const int n, const int i, int& x, int& y)
+{
+	if (order == ORDER_MORTON)
+	{
+		// de-interleave the bits of i
+		x = 0;
+		y = 0;
+		for (int bit = 0; (1 << bit) < n; bit++)
+		{
+			x |= ((i >> (2 * bit)) & 1) << bit;
+			y |= ((i >> (2 * bit + 1)) & 1) << bit;
+		}
+	}
+	else if (order == ORDER_HILBERT)
+	{
+		// cf https://en.wikipedia.org/wiki/Hilbert_curve
+		int t = i;
+		x = 0;
+		y = 0;
+		for (int s = 1; s < n; s *= 2)
+		{
+			int rx = 1 & (t / 2);
+			int ry = 1 & (t ^ rx);
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+			t /= 4;
+		}
+	}
+	else
+	{
+		x = i % n;
+		y = i / n;
+	}
+}
+
+// Cells of a w x h grid, in the order of the curve
+inline std::vector<Tile> curve_cells(const TileOrder order, const int w, const int h)
+{
+	int n = 1;
+	while (n < std::max(w, h))
+		n *= 2;
+
+	std::vector<Tile> cells;
+	for (int i = 0; i < n * n; i++)
+	{
+		Tile cell;
+		cell.width = 1;
+		cell.height = 1;
+		curve_cell(order, n, i, cell.x, cell.y);
+		if (cell.x < w && cell.y < h)
+			cells.push_back(cell);
+	}
+	return cells;
+}
+
+class TileScheduler
+{
+public:
+	TileScheduler(ThreadPool& pool, const int tileSize, const TileOrder order)
+		: m_pool(pool), m_tileSize(std::max(tileSize, 1)), m_order(order), m_queues(new TileQueue[pool.size()]) {}
+
+	int tileSize() const { return m_tileSize; }
+	int threads() const { return m_pool.size(); }
+
+	/*! decoupe l'image en tuiles et les tuiles en cellules de cellSize x cellSize pixels, puis appelle render(cell, thread)
+		pour chaque cellule, dans l'ordre de la courbe a l'interieur de chaque tuile. revient quand toutes les cellules sont calculees.
+	*/
+	template <typename F>
+	void run(const int width, const int height, const int cellSize, const F& render)
+	{
+		// tiles are a whole number of cells, the tiles follow the curve over the image too
+		int tileSize = std::max(m_tileSize / cellSize, 1) * cellSize;
+		int tilesX = (width + tileSize - 1) / tileSize;
+		int tilesY = (height + tileSize - 1) / tileSize;
+		std::vector<Tile> tiles = curve_cells(m_order, tilesX, tilesY);
+		for (size_t i = 0; i < tiles.size(); i++)
+		{
+			tiles[i].x *= tileSize;
+			tiles[i].y *= tileSize;
+			tiles[i].width = std::min(tileSize, width - tiles[i].x);
+			tiles[i].height = std::min(tileSize, height - tiles[i].y);
+		}
+		std::vector<Tile> cells = curve_cells(m_order, tileSize / cellSize, tileSize / cellSize);
+
+		// each thread starts with a contiguous range of tiles
+		int threads = m_pool.size();
+		for (int t = 0; t < threads; t++)
+		{
+			m_queues[t].tiles.clear();
+			size_t begin = tiles.size() * t / threads;
+			size_t end = tiles.size() * (t + 1) / threads;
+			for (size_t i = begin; i < end; i++)
+				m_queues[t].tiles.push_back((int)i);
+		}
+
+		m_pool.run([&](const int thread)
+		{
+			int tileId;
+			while (pop(thread, tileId) || steal(thread, tileId))
+			{
+				const Tile& tile = tiles[tileId];
+				for (size_t i = 0; i < cells.size(); i++)
+				{
+					Tile cell;
+					cell.x = tile.x + cells[i].x * cellSize;
+					cell.y = tile.y + cells[i].y * cellSize;
+					if (cell.x >= tile.x + tile.width || cell.y >= tile.y + tile.height)
+						continue;
+					cell.width = std::min(cellSize, tile.x + tile.width - cell.x);
+					cell.height = std::min(cellSize, tile.y + tile.height - cell.y);
+					render(cell, thread);
+				}
+			}
+		});
+	}
+
+protected:
+	struct TileQueue
+	{
+		std::mutex mutex;
+		std::deque<int> tiles;
+	};
+
+	// the owner takes the tiles at the front of its queue, the thieves at the back
+	bool pop(const int thread, int& tileId)
+	{
+		TileQueue& queue = m_queues[thread];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tiles.empty())
+			return false;
+		tileId = queue.tiles.front();
+		queue.tiles.pop_front();
+		return true;
+	}
+
+	bool steal(const int thread, int& tileId)
+	{
+		int threads = m_pool.size();
+		for (int i = 1; i < threads; i++)
+		{
+			TileQueue& queue = m_queues[(thread + i) % threads];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tiles.empty())
+				continue;
+			tileId = queue.tiles.back();
+			queue.tiles.pop_back();
+			return true;
+		}
+		return false;
+	}
+
+	ThreadPool& m_pool;
+	int m_tileSize;
+	TileOrder m_order;
+	std::unique_ptr<TileQueue[]> m_queues;
+};
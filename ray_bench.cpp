@@ -0,0 +1,384 @@
+// Ray tracing throughput benchmark
+// Builds the BVH of each scene with every builder and traces the same sets of rays with every traversal :
+//	primary : camera rays, in blocks of PACKET_SIZE x PACKET_SIZE pixels, also traced as packets,
+//	ao : occlusion rays in the cosine weighted hemisphere of the primary hits,
+//	random : random origins in the scene box, random directions.
+// The rays are generated from fixed seeds, two runs trace the same rays. The BVH is built again for each thread count,
+// with as many OpenMP threads as the pool. The instances traversal uses a scene of one instance of the mesh, its hits are
+// the hits of the other traversals. The wavefront render is not measured : it shades whole images, cf ray_tuto -wavefront.
+//
+// ray_bench [-threads 1,2,4] [-size 512] [-repeat 3] [-json ray_bench.json] [scene.obj ...]
+
+#define RAY_TUTO_NO_MAIN
+#include "ray_tuto.cpp"
+
+#include <thread>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct RaySet
+{
+	string name;
+	vector<Ray> rays;
+	bool occlusion;		//!< requetes d'occultation, sinon intersection la plus proche.
+	bool coherent;		//!< rayons ranges par blocs de PACKET_RAYS, peuvent etre traces en paquets.
+};
+
+struct BenchOptions
+{
+	vector<int> threads;
+	int size = 512;
+	int repeat = 3;
+	string json = "ray_bench.json";
+	vector<string> scenes;
+};
+
+bool parse_bench_options(int argc, char **argv, BenchOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string option = argv[i];
+		if (option[0] != '-')
+		{
+			options.scenes.push_back(option);
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			printf("[error] option '%s' without value...\n", option.c_str());
+			return false;
+		}
+
+		string value = argv[++i];
+		if (option == "-threads")
+		{
+			options.threads.clear();
+			for (size_t begin = 0; begin < value.size(); )
+			{
+				size_t end = value.find(',', begin);
+				if (end == string::npos)
+					end = value.size();
+				int n = atoi(value.substr(begin, end - begin).c_str());
+				if (n <= 0)
+				{
+					printf("[error] invalid thread count '%s'...\n", value.c_str());
+					return false;
+				}
+				options.threads.push_back(n);
+				begin = end + 1;
+			}
+		}
+		else if (option == "-size")
+			options.size = std::max(atoi(value.c_str()), PACKET_SIZE);
+		else if (option == "-repeat")
+			options.repeat = std::max(atoi(value.c_str()), 1);
+		else if (option == "-json")
+			options.json = value;
+		else
+		{
+			printf("[error] unknown option '%s'...\n", option.c_str());
+			return false;
+		}
+	}
+
+	if (options.threads.empty())
+	{
+		options.threads.push_back(1);
+		int n = (int)std::thread::hardware_concurrency();
+		if (n > 1)
+			options.threads.push_back(n);
+	}
+	if (options.scenes.empty())
+	{
+		const char *scenes[] = { "cornell", "emission", "geometry", "secondary", "shadow" };
+		for (int i = 0; i < 5; i++)
+			options.scenes.push_back(string("m2tp/TutoRayTrace/") + scenes[i] + ".obj");
+	}
+	return true;
+}
+
+AABB scene_bounds(const vector<Triangle>& triangles)
+{
+	AABB bounds = AABB::empty();
+	for (size_t i = 0; i < triangles.size(); i++)
+		bounds.grow(make_primitive(triangles[i], 0).bounds);
+	return bounds;
+}
+
+// Primary rays, the pixels of a block are consecutive
+RaySet primary_rays(const AABB& bounds, const int size)
+{
+	RaySet set;
+	set.name = "primary";
+	set.occlusion = false;
+	set.coherent = true;
+
+	Orbiter camera;
+	camera.lookat(bounds.center(), length(Vector(bounds.minPoint, bounds.maxPoint)) / 2);
+	Point dO;
+	Vector dx, dy;
+	camera.frame(size, size, 1.0f, 60.0f, dO, dx, dy);
+	Point o = camera.position();
+
+	PCG32 rng(1);
+	for (int by = 0; by + PACKET_SIZE <= size; by += PACKET_SIZE)
+		for (int bx = 0; bx + PACKET_SIZE <= size; bx += PACKET_SIZE)
+			for (int y = by; y < by + PACKET_SIZE; y++)
+				for (int x = bx; x < bx + PACKET_SIZE; x++)
+					set.rays.push_back(Ray(o, dO + (x + rng.uniform()) * dx + (y + rng.uniform()) * dy));
+	return set;
+}
+
+// Occlusion rays from the hits of the primary rays, limited to a quarter of the scene diagonal
+RaySet ao_rays(const RaySet& primary, const AABB& bounds, const int raysPerHit)
+{
+	RaySet set;
+	set.name = "ao";
+	set.occlusion = true;
+	set.coherent = false;
+
+	float distance = length(Vector(bounds.minPoint, bounds.maxPoint)) / 4;
+	PCG32 rng(2);
+	for (size_t i = 0; i < primary.rays.size(); i++)
+	{
+		Hit hit;
+		hit.t = primary.rays[i].tmax;
+		if (intersect_scene(primary.rays[i], hit) == false)
+			continue;
+
+		Vector n = normalize(hit.n);
+		if (dot(n, primary.rays[i].d) > 0)
+			n = -n;
+		Vector t = normalize(std::abs(n.x) > 0.9f ? cross(n, Vector(0, 1, 0)) : cross(n, Vector(1, 0, 0)));
+		Vector b = cross(n, t);
+		for (int k = 0; k < raysPerHit; k++)
+		{
+			// cosine weighted direction
+			float u = rng.uniform(), v = rng.uniform();
+			float r = std::sqrt(u);
+			float phi = 2 * float(M_PI) * v;
+			Vector d = r * std::cos(phi) * t + r * std::sin(phi) * b + std::sqrt(1 - u) * n;
+			Ray ray(hit.p + 0.001f * n, d * distance);
+			ray.tmax = 1;
+			set.rays.push_back(ray);
+		}
+	}
+	return set;
+}
+
+// Random rays through the scene box
+RaySet random_rays(const AABB& bounds, const int count)
+{
+	RaySet set;
+	set.name = "random";
+	set.occlusion = false;
+	set.coherent = false;
+
+	Vector extent(bounds.minPoint, bounds.maxPoint);
+	PCG32 rng(3);
+	for (int i = 0; i < count; i++)
+	{
+		Point o = bounds.minPoint + Vector(rng.uniform() * extent.x, rng.uniform() * extent.y, rng.uniform() * extent.z);
+		float z = 1 - 2 * rng.uniform();
+		float r = std::sqrt(std::max(0.0f, 1 - z * z));
+		float phi = 2 * float(M_PI) * rng.uniform();
+		set.rays.push_back(Ray(o, Vector(r * std::cos(phi), r * std::sin(phi), z)));
+	}
+	return set;
+}
+
+// Trace the set on every thread of the pool, by chunks of rays, returns the number of hits
+const int BENCH_CHUNK = 16 * PACKET_RAYS;
+
+long trace(ThreadPool& pool, const RaySet& set, const bool packets)
+{
+	std::atomic<int> next(0);
+	std::atomic<long> hits(0);
+	int count = (int)set.rays.size();
+	pool.run([&](const int thread)
+	{
+		long found = 0;
+		int begin;
+		while ((begin = next.fetch_add(BENCH_CHUNK)) < count)
+		{
+			int end = std::min(begin + BENCH_CHUNK, count);
+			if (packets)
+			{
+				for (int first = begin; first < end; first += PACKET_RAYS)
+				{
+					RayPacket packet;
+					for (int i = first; i < std::min(first + PACKET_RAYS, end); i++)
+						packet.add(set.rays[i]);
+					Hit h[PACKET_RAYS];
+					intersect_packet(packet, h);
+					for (int i = 0; i < packet.count; i++)
+						found += h[i].object_id != -1;
+				}
+			}
+			else if (set.occlusion)
+			{
+				for (int i = begin; i < end; i++)
+					found += occluded(set.rays[i], set.rays[i].tmax);
+			}
+			else
+			{
+				for (int i = begin; i < end; i++)
+				{
+					Hit hit;
+					hit.t = set.rays[i].tmax;
+					found += intersect_scene(set.rays[i], hit);
+				}
+			}
+		}
+		hits += found;
+	});
+	return hits;
+}
+
+struct BenchResult
+{
+	string scene;
+	int triangles;
+	string builder;
+	int nodes;
+	int buildTime;
+	string traversal;
+	string rays;
+	int rayCount;
+	int threads;
+	double mrays;
+	long hits;
+};
+
+void write_json(const char *filename, const vector<BenchResult>& results)
+{
+	FILE *out = fopen(filename, "wt");
+	if (out == NULL)
+	{
+		printf("[error] writing '%s'...\n", filename);
+		return;
+	}
+
+	fprintf(out, "{\n\t\"results\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& r = results[i];
+		fprintf(out, "\t\t{ \"scene\": \"%s\", \"triangles\": %d, \"builder\": \"%s\", \"nodes\": %d, \"build_ms\": %d, "
+			"\"traversal\": \"%s\", \"rays\": \"%s\", \"ray_count\": %d, \"threads\": %d, \"mrays_per_s\": %.3f, \"hits\": %ld }%s\n",
+			r.scene.c_str(), r.triangles, r.builder.c_str(), r.nodes, r.buildTime,
+			r.traversal.c_str(), r.rays.c_str(), r.rayCount, r.threads, r.mrays, r.hits,
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "\t],\n\t\"excluded\": [\n");
+	fprintf(out, "\t\t{ \"traversal\": \"wavefront\", \"reason\": \"shades whole images, measured by ray_tuto -wavefront\" }\n");
+	fprintf(out, "\t]\n}\n");
+	fclose(out);
+	printf("%d results written to '%s'.\n", (int)results.size(), filename);
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+	if (parse_bench_options(argc, argv, options) == false)
+		return 1;
+
+	const BVHBuilder builders[] = { BVH_MIDDLE, BVH_SAH, BVH_SAH_PARALLEL, BVH_SBVH };
+	const BVHTraversal traversals[] = { TRAVERSAL_BVH2, TRAVERSAL_QBVH, TRAVERSAL_QBVH_COMPRESSED, TRAVERSAL_INSTANCES };
+	const char *traversalNames[] = { "bvh2", "qbvh", "qbvh_compressed", "instances" };
+
+	vector<BenchResult> results;
+	for (size_t s = 0; s < options.scenes.size(); s++)
+	{
+		Mesh mesh = read_mesh(options.scenes[s].c_str());
+		if (mesh == Mesh::error() || mesh.triangle_count() == 0)
+			continue;
+
+		for (int b = 0; b < 4; b++)
+		{
+			vector<RaySet> sets;
+			for (size_t t = 0; t < options.threads.size(); t++)
+			{
+				// the builders use the OpenMP threads, as many as the threads of the traversal
+				ThreadPool pool(options.threads[t]);
+#ifdef _OPENMP
+				omp_set_num_threads(pool.size());
+#endif
+				triangles.clear();
+				primitives.clear();
+				build_triangles(mesh);
+				chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+				rootNodeId = build_bvh(bvh, triangles, primitives, builders[b], bvhLeafSize);
+				int buildTime = (int)chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count();
+				build_qbvh(qbvh, bvh);
+				build_compressed_qbvh(compressedQbvh, bvh);
+				build_triangle_soa(triangleSoA, triangles);
+
+				// scene of one instance of the mesh, built with the same builder
+				meshBVHs.clear();
+				instances.clear();
+				sources.clear();
+				{
+					MeshBVH instanced;
+					instanced.mesh = mesh;
+					vector<Primitive> meshPrimitives;
+					build_triangles(instanced.mesh, instanced.triangles, meshPrimitives);
+					build_bvh(instanced.nodes, instanced.triangles, meshPrimitives, builders[b], bvhLeafSize);
+					build_triangle_soa(instanced.soa, instanced.triangles);
+					meshBVHs.push_back(std::move(instanced));
+					instances.push_back(Instance(0, Identity()));
+					build_instances(builders[b]);
+				}
+
+				// the same rays for every builder
+				if (sets.empty())
+				{
+					AABB bounds = scene_bounds(triangles);
+					traversal = TRAVERSAL_BVH2;
+					sets.push_back(primary_rays(bounds, options.size));
+					sets.push_back(ao_rays(sets[0], bounds, 4));
+					sets.push_back(random_rays(bounds, options.size * options.size));
+				}
+
+				for (size_t r = 0; r < sets.size(); r++)
+				{
+					// the packets only trace the binary BVH
+					int variants = sets[r].coherent && sets[r].occlusion == false ? 5 : 4;
+					for (int v = 0; v < variants; v++)
+					{
+						bool packets = (v == 4);
+						traversal = packets ? TRAVERSAL_BVH2 : traversals[v];
+
+						double best = DBL_MAX;
+						long hits = 0;
+						for (int k = 0; k < options.repeat; k++)
+						{
+							chrono::high_resolution_clock::time_point begin = chrono::high_resolution_clock::now();
+							hits = trace(pool, sets[r], packets);
+							best = std::min(best, chrono::duration<double>(chrono::high_resolution_clock::now() - begin).count());
+						}
+
+						BenchResult result;
+						result.scene = options.scenes[s];
+						result.triangles = mesh.triangle_count();
+						result.builder = bvhBuilderNames[builders[b]];
+						result.nodes = (int)bvh.size();
+						result.buildTime = buildTime;
+						result.traversal = packets ? "packets" : traversalNames[v];
+						result.rays = sets[r].name;
+						result.rayCount = (int)sets[r].rays.size();
+						result.threads = pool.size();
+						result.mrays = sets[r].rays.size() / std::max(best, 1e-9) / 1e6;
+						result.hits = hits;
+						results.push_back(result);
+						printf("%s, %s builder, %s, %s rays, %d threads : %.2f Mrays/s, %ld hits\n", result.scene.c_str(), result.builder.c_str(),
+							result.traversal.c_str(), result.rays.c_str(), result.threads, result.mrays, result.hits);
+					}
+				}
+			}
+		}
+	}
+
+	write_json(options.json.c_str(), results);
+	return 0;
+}
@@ -1,7 +1,27 @@
 #include <cfloat>
 #include <cmath>
 #include <time.h>
+#include <cstdlib>
+#include <string>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
 
 #include "vec.h"
 #include "color.h"
@@ -13,10 +33,80 @@
 #include "image_hdr.h"
 #include "orbiter.h"
 
+#include "Sampler.h"
+#include "TileScheduler.h"
+#include "Denoiser.h"
+#include "ImageStream.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE
+#include <immintrin.h>
+#endif
+#if defined(__AVX2__)
+#define USE_AVX2
+#endif
+
 #define EPSILON 0.00001f
 
+// Traversal statistics, compiled only with RAY_STATS defined, cf -DRAY_STATS
+// the counters of the rays traced by a thread are reset and read for each pixel, RAY_STAT(statement) disappears without RAY_STATS
+#ifdef RAY_STATS
+struct RayStats
+{
+	unsigned int rays = 0;
+	unsigned int nodes = 0;		//!< noeuds visites.
+	unsigned int boxes = 0;		//!< tests rayon / boite.
+	unsigned int triangles = 0;	//!< tests rayon / triangle.
+	unsigned int depth = 0;		//!< profondeur max de la pile de parcours.
+
+	void add(const RayStats& stats)
+	{
+		rays += stats.rays;
+		nodes += stats.nodes;
+		boxes += stats.boxes;
+		triangles += stats.triangles;
+		depth = std::max(depth, stats.depth);
+	}
+
+	//! renvoie la part d'un rayon d'un paquet de n rayons.
+	RayStats share(const unsigned int n) const
+	{
+		RayStats stats;
+		stats.rays = (rays + n - 1) / n;
+		stats.nodes = (nodes + n - 1) / n;
+		stats.boxes = (boxes + n - 1) / n;
+		stats.triangles = (triangles + n - 1) / n;
+		stats.depth = depth;
+		return stats;
+	}
+};
+
+thread_local RayStats rayStats;
+#define RAY_STAT(statement) statement
+#else
+#define RAY_STAT(statement)
+#endif
+
 using namespace std;
 
+// Tools
+Point min(const Point& a, const Point& b)
+{
+	return Point(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z));
+}
+Point max(const Point& a, const Point& b)
+{
+	return Point(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z));
+}
+Vector min(const Vector& a, const Vector& b)
+{
+	return Vector(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z));
+}
+Vector max(const Vector& a, const Vector& b)
+{
+	return Vector(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z));
+}
+
 // Structures
 struct Ray
 {
@@ -24,6 +114,7 @@ struct Ray
 	Vector d;	//!< direction.
 	float tmax;	//!< abscisse max pour les intersections valides.
 
+	Ray() : o(), d(), tmax(FLT_MAX) {}
 	Ray(const Point origine, const Point extremite) : o(origine), d(Vector(origine, extremite)), tmax(1) {}
 	Ray(const Point origine, const Vector direction) : o(origine), d(direction), tmax(FLT_MAX) {}
 
@@ -37,13 +128,16 @@ struct Hit
 	float t;	    //!< t, abscisse sur le rayon.
 	float u, v;	    //!< u, v coordonnees barycentrique dans le triangle.
 	int object_id;  //! indice du triangle dans le maillage.
+	int instance_id;	//! indice de l'instance touchee, -1 sans instances.
 
-	Hit() : p(), n(), t(FLT_MAX), u(0), v(0), object_id(-1) {}
+	Hit() : p(), n(), t(FLT_MAX), u(0), v(0), object_id(-1), instance_id(-1) {}
 };
 struct Triangle : public TriangleData
 {
-	Triangle() : TriangleData() {}
-	Triangle(const TriangleData& data) : TriangleData(data) {}
+	int id;	//!< indice du triangle dans le maillage, les triangles sont reordonnes par le BVH.
+
+	Triangle() : TriangleData(), id(-1) {}
+	Triangle(const TriangleData& data, const int _id = -1) : TriangleData(data), id(_id) {}
 
 	/* calcule l'intersection ray/triangle
 	cf "fast, minimum storage ray-triangle intersection"
@@ -119,7 +213,7 @@ struct Source : public Triangle
 	Color emission;     //! flux emis.
 
 	Source() : Triangle(), emission() {}
-	Source(const TriangleData& data, const Color& color) : Triangle(data), emission(color) {}
+	Source(const TriangleData& data, const Color& color, const int _id = -1) : Triangle(data, _id), emission(color) {}
 };
 struct AABB
 {
@@ -128,20 +222,57 @@ public:
 	Point maxPoint = Point(0, 0, 0);
 
 	AABB() { }
+	AABB(const Point& pmin, const Point& pmax) : minPoint(pmin), maxPoint(pmax) { }
+
+	//! renvoie une boite vide, prete a etre agrandie par grow().
+	static AABB empty()
+	{
+		return AABB(Point(FLT_MAX, FLT_MAX, FLT_MAX), Point(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	}
+
+	void grow(const Point& p)
+	{
+		minPoint = min(minPoint, p);
+		maxPoint = max(maxPoint, p);
+	}
+	void grow(const AABB& b)
+	{
+		minPoint = min(minPoint, b.minPoint);
+		maxPoint = max(maxPoint, b.maxPoint);
+	}
+
+	Point center() const
+	{
+		return Point((Vector(minPoint) + Vector(maxPoint)) / 2.0f);
+	}
+
+	//! renvoie l'aire de la surface de la boite, utilisee par la SAH.
+	float area() const
+	{
+		Vector e(minPoint, maxPoint);
+		if (e.x < 0 || e.y < 0 || e.z < 0)
+			return 0.0f;
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
 
 	bool intersect(const Ray& ray, const float htmax, float& rtmin, float& rtmax) const
 	{
 		Vector invd = Vector(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
-		// remarque : il est un peu plus rapide de stocker invd dans la structure Ray, ou dans l'appellant / algo de parcours, au lieu de la recalculer  chaque fois
+		// remarque : il est un peu plus rapide de stocker invd dans la structure Ray, ou dans l'appellant / algo de parcours, au lieu de la recalculer à chaque fois
+		return intersect(ray, invd, htmax, rtmin, rtmax);
+	}
 
+	//! meme test, avec l'inverse de la direction du rayon calcule une seule fois par l'algo de parcours.
+	bool intersect(const Ray& ray, const Vector& invd, const float htmax, float& rtmin, float& rtmax) const
+	{
 		Point rmin = minPoint;
 		Point rmax = maxPoint;
 		if (ray.d.x < 0) std::swap(rmin.x, rmax.x);    // le rayon entre dans la bbox par pmax et ressort par pmin, echanger...
 		if (ray.d.y < 0) std::swap(rmin.y, rmax.y);
 		if (ray.d.z < 0) std::swap(rmin.z, rmax.z);
 
-		Vector dmin = (rmin - ray.o) * invd;           // intersection avec les plans -U -V -W attachs  rmin
-		Vector dmax = (rmax - ray.o) * invd;           // intersection avec les plans +U +V +W attachs  rmax
+		Vector dmin = (rmin - ray.o) * invd;           // intersection avec les plans -U -V -W attachés à rmin
+		Vector dmax = (rmax - ray.o) * invd;           // intersection avec les plans +U +V +W attachés à rmax
 		rtmin = std::max(dmin.x, std::max(dmin.y, std::max(dmin.z, 0.f)));        // borne min de l'intervalle d'intersection
 		rtmax = std::min(dmax.x, std::min(dmax.y, std::min(dmax.z, htmax)));      // borne max
 
@@ -153,18 +284,435 @@ struct Primitive
 {
 	AABB bounds;
 	Point center;
-	int triangleId;
+	int triangleId;		//!< indice du triangle, ou de l'instance pour le BVH des instances.
 };
-struct BVHNode
+struct BVHBuildNode
 {
 public:
 	AABB aabb;
 	int leftId;
 	int rightId;
-	int triangleId;
+	int firstPrimitive;	//!< feuille : indice de la premiere primitive dans primitives.
+	int primitiveCount;	//!< feuille : nombre de primitives, 0 pour un noeud interne.
+
+	BVHBuildNode(const AABB& b) : aabb(b), leftId(-1), rightId(-1), firstPrimitive(-1), primitiveCount(0) { }
+	BVHBuildNode(const AABB& b, const int& l, const int& r) : aabb(b), leftId(l), rightId(r), firstPrimitive(-1), primitiveCount(0) { }
+
+	//! construit une feuille qui reference les primitives [first .. first + count[.
+	static BVHBuildNode leaf(const AABB& b, const int first, const int count)
+	{
+		BVHBuildNode node(b);
+		node.firstPrimitive = first;
+		node.primitiveCount = count;
+		return node;
+	}
+
+	bool isLeaf() const { return primitiveCount > 0; }
+};
+struct BVHNode
+{
+public:
+	AABB aabb;
+	int offset;			//!< noeud interne : indice du fils droit, le fils gauche suit le noeud. feuille : indice du premier triangle.
+	int triangleCount;	//!< feuille : nombre de triangles, 0 pour un noeud interne.
+
+	BVHNode(const AABB& b, const int o, const int count) : aabb(b), offset(o), triangleCount(count) { }
+
+	bool isLeaf() const { return triangleCount > 0; }
+};
+
+// 4-wide BVH node : the boxes of the 4 children are stored by coordinate, to be tested together
+struct alignas(16) QBVHNode
+{
+	float minX[4], minY[4], minZ[4];
+	float maxX[4], maxY[4], maxZ[4];
+	int child[4];	//!< noeud interne : indice du fils, feuille : indice du premier triangle.
+	int count[4];	//!< feuille : nombre de triangles, 0 pour un noeud interne, -1 pour un fils absent.
+
+	QBVHNode()
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			// empty slot, ignored by intersect()
+			minX[i] = minY[i] = minZ[i] = FLT_MAX;
+			maxX[i] = maxY[i] = maxZ[i] = -FLT_MAX;
+			child[i] = -1;
+			count[i] = -1;
+		}
+	}
+
+	void setChild(const int i, const AABB& b, const int c, const int n)
+	{
+		minX[i] = b.minPoint.x; minY[i] = b.minPoint.y; minZ[i] = b.minPoint.z;
+		maxX[i] = b.maxPoint.x; maxY[i] = b.maxPoint.y; maxZ[i] = b.maxPoint.z;
+		child[i] = c;
+		count[i] = n;
+	}
+
+	//! intersection du rayon avec les 4 boites, renvoie un masque des boites touchees et les abscisses d'entree.
+	int intersect(const Ray& ray, const Vector& invd, const float htmax, float rtmin[4]) const
+	{
+#ifdef USE_SSE
+		__m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y), oz = _mm_set1_ps(ray.o.z);
+		__m128 ix = _mm_set1_ps(invd.x), iy = _mm_set1_ps(invd.y), iz = _mm_set1_ps(invd.z);
+		__m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(minX), ox), ix);
+		__m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxX), ox), ix);
+		__m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(minY), oy), iy);
+		__m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxY), oy), iy);
+		__m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(minZ), oz), iz);
+		__m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxZ), oz), iz);
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(htmax)));
+		_mm_storeu_ps(rtmin, tmin);
+		__m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_load_si128((const __m128i*) count), _mm_set1_epi32(-1)));
+		return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tmin, tmax), valid));
+#else
+		int mask = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			float x0 = (minX[i] - ray.o.x) * invd.x, x1 = (maxX[i] - ray.o.x) * invd.x;
+			float y0 = (minY[i] - ray.o.y) * invd.y, y1 = (maxY[i] - ray.o.y) * invd.y;
+			float z0 = (minZ[i] - ray.o.z) * invd.z, z1 = (maxZ[i] - ray.o.z) * invd.z;
+			float tmin = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::max(std::min(z0, z1), 0.f));
+			float tmax = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::min(std::max(z0, z1), htmax));
+			rtmin[i] = tmin;
+			if (tmin <= tmax && count[i] >= 0)
+				mask |= 1 << i;
+		}
+		return mask;
+#endif
+	}
+};
+
+// Compressed 4-wide BVH node : the boxes of the children are quantized on 8 bits in the box of the node,
+// with a power of 2 scale per axis, rounded outwards. 64 bytes per node instead of 128 for QBVHNode.
+struct alignas(16) CompressedQBVHNode
+{
+	float origin[3];		//!< coin min de la boite du noeud.
+	int8_t exponent[3];		//!< echelle des coordonnees quantifiees, 2^exponent par axe.
+	uint8_t valid;			//!< masque des fils presents.
+	uint8_t qminX[4], qminY[4], qminZ[4];
+	uint8_t qmaxX[4], qmaxY[4], qmaxZ[4];
+	int child[4];			//!< noeud interne : indice du fils, feuille : indice du premier triangle.
+	int16_t count[4];		//!< feuille : nombre de triangles, 0 pour un noeud interne, -1 pour un fils absent.
+
+	CompressedQBVHNode() { }
+
+	//! quantifie les boites des fils d'un noeud.
+	CompressedQBVHNode(const QBVHNode& node)
+	{
+		const float *mins[3] = { node.minX, node.minY, node.minZ };
+		const float *maxs[3] = { node.maxX, node.maxY, node.maxZ };
+		uint8_t *qmins[3] = { qminX, qminY, qminZ };
+		uint8_t *qmaxs[3] = { qmaxX, qmaxY, qmaxZ };
+
+		valid = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			child[i] = node.child[i];
+			count[i] = (int16_t)node.count[i];
+			if (node.count[i] >= 0)
+				valid |= 1 << i;
+		}
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float lo = FLT_MAX, hi = -FLT_MAX;
+			for (int i = 0; i < 4; i++)
+			{
+				if ((valid & (1 << i)) == 0)
+					continue;
+				lo = std::min(lo, mins[axis][i]);
+				hi = std::max(hi, maxs[axis][i]);
+			}
+			if (valid == 0)
+				lo = hi = 0;
+
+			// smallest scale so that 255 steps cover the box, the differences of floats are exact in double
+			int e;
+			frexp(((double)hi - lo) / 255.0, &e);
+			e = std::max(e, -100);
+			while ((double)lo + ldexp(255.0, e) < hi)
+				e++;
+			origin[axis] = lo;
+			exponent[axis] = (int8_t)e;
+
+			for (int i = 0; i < 4; i++)
+			{
+				if ((valid & (1 << i)) == 0)
+				{
+					qmins[axis][i] = 0;
+					qmaxs[axis][i] = 0;
+					continue;
+				}
+				double qmin = floor(ldexp((double)mins[axis][i] - lo, -e));
+				double qmax = ceil(ldexp((double)maxs[axis][i] - lo, -e));
+				qmins[axis][i] = (uint8_t)std::max(qmin, 0.0);
+				qmaxs[axis][i] = (uint8_t)std::min(qmax, 255.0);
+			}
+		}
+	}
+
+	//! intersection du rayon avec les 4 boites decodees, renvoie un masque des boites touchees et les abscisses d'entree.
+	int intersect(const Ray& ray, const Vector& invd, const float htmax, float rtmin[4]) const
+	{
+		// t = (q * scale + origin - o) * invd, for each axis. The box is decoded before the product by invd, as in QBVHNode :
+		// invd is infinite when the direction is parallel to an axis, q * scale * invd would give 0 * inf = NaN.
+		float sx = scale(exponent[0]), ox = origin[0] - ray.o.x;
+		float sy = scale(exponent[1]), oy = origin[1] - ray.o.y;
+		float sz = scale(exponent[2]), oz = origin[2] - ray.o.z;
+#ifdef USE_SSE
+		__m128 ssx = _mm_set1_ps(sx), sox = _mm_set1_ps(ox), sdx = _mm_set1_ps(invd.x);
+		__m128 ssy = _mm_set1_ps(sy), soy = _mm_set1_ps(oy), sdy = _mm_set1_ps(invd.y);
+		__m128 ssz = _mm_set1_ps(sz), soz = _mm_set1_ps(oz), sdz = _mm_set1_ps(invd.z);
+		__m128 x0 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qminX), ssx), sox), sdx);
+		__m128 x1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qmaxX), ssx), sox), sdx);
+		__m128 y0 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qminY), ssy), soy), sdy);
+		__m128 y1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qmaxY), ssy), soy), sdy);
+		__m128 z0 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qminZ), ssz), soz), sdz);
+		__m128 z1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(decode(qmaxZ), ssz), soz), sdz);
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(htmax)));
+		_mm_storeu_ps(rtmin, tmin);
+		return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) & valid;
+#else
+		int mask = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			float x0 = (qminX[i] * sx + ox) * invd.x, x1 = (qmaxX[i] * sx + ox) * invd.x;
+			float y0 = (qminY[i] * sy + oy) * invd.y, y1 = (qmaxY[i] * sy + oy) * invd.y;
+			float z0 = (qminZ[i] * sz + oz) * invd.z, z1 = (qmaxZ[i] * sz + oz) * invd.z;
+			float tmin = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::max(std::min(z0, z1), 0.f));
+			float tmax = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::min(std::max(z0, z1), htmax));
+			rtmin[i] = tmin;
+			if (tmin <= tmax)
+				mask |= 1 << i;
+		}
+		return mask & valid;
+#endif
+	}
+
+protected:
+	// 2^e, built from the bits of the float
+	static float scale(const int e)
+	{
+		uint32_t bits = (uint32_t)(e + 127) << 23;
+		float f;
+		memcpy(&f, &bits, 4);
+		return f;
+	}
+
+#ifdef USE_SSE
+	// 4 bytes to 4 floats
+	static __m128 decode(const uint8_t q[4])
+	{
+		int bytes;
+		memcpy(&bytes, q, 4);
+		__m128i zero = _mm_setzero_si128();
+		__m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+		return _mm_cvtepi32_ps(v);
+	}
+#endif
+};
+
+// Node of the light hierarchy, same depth first layout as BVHNode, with one source per leaf
+struct LightNode
+{
+public:
+	AABB aabb;
+	float power;		//!< puissance emise par les sources du noeud.
+	int offset;			//!< noeud interne : indice du fils droit, le fils gauche suit le noeud. feuille : indice de la source.
+	int sourceCount;	//!< feuille : 1, 0 pour un noeud interne.
+
+	LightNode(const AABB& b, const float p, const int o, const int count) : aabb(b), power(p), offset(o), sourceCount(count) { }
+
+	bool isLeaf() const { return sourceCount > 0; }
+};
+
+// Triangles stored by coordinate with their precomputed edges, for the 8-wide intersection kernel
+// the arrays are padded, so the last group of 8 triangles can be loaded without checking the bounds
+struct TriangleSoA
+{
+	vector<float> ax, ay, az;		//!< sommet a.
+	vector<float> abx, aby, abz;	//!< arete ab.
+	vector<float> acx, acy, acz;	//!< arete ac.
+	int count = 0;
+
+	/* calcule l'intersection du rayon et des triangles [begin .. end[, cf Triangle::intersect().
+	renvoie l'indice du triangle le plus proche touche avant htmax, ou -1 + ses coordonnees (rt, ru, rv). \n
+	htmax est mis a jour avec l'abscisse de l'intersection.
+	*/
+	int intersect(const Ray& ray, const int begin, const int end, float& htmax, float& ru, float& rv) const
+	{
+		RAY_STAT(rayStats.triangles += end - begin);
+		int id = -1;
+#ifdef USE_AVX2
+		static const int tailMask[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+		__m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+		__m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y), oz = _mm256_set1_ps(ray.o.z);
+		__m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+		__m256 epsilon = _mm256_set1_ps(EPSILON), mepsilon = _mm256_set1_ps(-EPSILON);
+		for (int i = begin; i < end; i += 8)
+		{
+			/* begin calculating determinant - also used to calculate U parameter */
+			__m256 e2x = _mm256_loadu_ps(&acx[i]), e2y = _mm256_loadu_ps(&acy[i]), e2z = _mm256_loadu_ps(&acz[i]);
+			__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+			__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+			__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+
+			/* if determinant is near zero, ray lies in plane of triangle */
+			__m256 e1x = _mm256_loadu_ps(&abx[i]), e1y = _mm256_loadu_ps(&aby[i]), e1z = _mm256_loadu_ps(&abz[i]);
+			__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+			__m256 valid = _mm256_or_ps(_mm256_cmp_ps(det, epsilon, _CMP_GE_OQ), _mm256_cmp_ps(det, mepsilon, _CMP_LE_OQ));
+			valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*) &tailMask[8 - std::min(end - i, 8)])));
+			__m256 invDet = _mm256_div_ps(one, det);
+
+			/* calculate distance from vert0 to ray origin */
+			__m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(&ax[i]));
+			__m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(&ay[i]));
+			__m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(&az[i]));
+
+			/* calculate U parameter and test bounds */
+			__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+			/* prepare to test V parameter */
+			__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+			__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+			__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+			/* calculate V parameter and test bounds */
+			__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+
+			/* calculate t, ray intersects triangle */
+			__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, epsilon, _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(htmax), _CMP_LE_OQ)));
+
+			int mask = _mm256_movemask_ps(valid);
+			if (mask == 0)
+				continue;
 
-	BVHNode(const AABB& b) : aabb(b), leftId(-1), rightId(-1), triangleId(-1) { }
-	BVHNode(const AABB& b, const int& l, const int& r, const int& t) : aabb(b), leftId(l), rightId(r), triangleId(t) { }
+			// keep the closest of the valid intersections
+			float lt[8], lu[8], lv[8];
+			_mm256_storeu_ps(lt, t);
+			_mm256_storeu_ps(lu, u);
+			_mm256_storeu_ps(lv, v);
+			for (int k = 0; k < 8; k++)
+			{
+				if ((mask & (1 << k)) && lt[k] <= htmax)
+				{
+					htmax = lt[k];
+					ru = lu[k];
+					rv = lv[k];
+					id = i + k;
+				}
+			}
+		}
+#else
+		for (int i = begin; i < end; i++)
+		{
+			Vector ab(abx[i], aby[i], abz[i]);
+			Vector ac(acx[i], acy[i], acz[i]);
+			Vector pvec = cross(ray.d, ac);
+			float det = dot(ab, pvec);
+			if (det > -EPSILON && det < EPSILON)
+				continue;
+
+			float inv_det = 1.0f / det;
+			Vector tvec(Point(ax[i], ay[i], az[i]), ray.o);
+			float u = dot(tvec, pvec) * inv_det;
+			if (u < 0.0f || u > 1.0f)
+				continue;
+
+			Vector qvec = cross(tvec, ab);
+			float v = dot(ray.d, qvec) * inv_det;
+			if (v < 0.0f || u + v > 1.0f)
+				continue;
+
+			float t = dot(ac, qvec) * inv_det;
+			if (t <= htmax && t > EPSILON)
+			{
+				htmax = t;
+				ru = u;
+				rv = v;
+				id = i;
+			}
+		}
+#endif
+		return id;
+	}
+
+	//! renvoie vrai si le rayon touche un des triangles [begin .. end[ avant htmax, sans chercher le plus proche.
+	bool occluded(const Ray& ray, const int begin, const int end, const float htmax) const
+	{
+		RAY_STAT(rayStats.triangles += end - begin);
+#ifdef USE_AVX2
+		static const int tailMask[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+		__m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+		__m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y), oz = _mm256_set1_ps(ray.o.z);
+		__m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+		__m256 epsilon = _mm256_set1_ps(EPSILON), mepsilon = _mm256_set1_ps(-EPSILON);
+		__m256 tmax = _mm256_set1_ps(htmax);
+		for (int i = begin; i < end; i += 8)
+		{
+			__m256 e2x = _mm256_loadu_ps(&acx[i]), e2y = _mm256_loadu_ps(&acy[i]), e2z = _mm256_loadu_ps(&acz[i]);
+			__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+			__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+			__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+
+			__m256 e1x = _mm256_loadu_ps(&abx[i]), e1y = _mm256_loadu_ps(&aby[i]), e1z = _mm256_loadu_ps(&abz[i]);
+			__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+			__m256 valid = _mm256_or_ps(_mm256_cmp_ps(det, epsilon, _CMP_GE_OQ), _mm256_cmp_ps(det, mepsilon, _CMP_LE_OQ));
+			valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*) &tailMask[8 - std::min(end - i, 8)])));
+			__m256 invDet = _mm256_div_ps(one, det);
+
+			__m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(&ax[i]));
+			__m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(&ay[i]));
+			__m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(&az[i]));
+			__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+			__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+			__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+			__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+			__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+
+			__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, epsilon, _CMP_GT_OQ), _mm256_cmp_ps(t, tmax, _CMP_LE_OQ)));
+			if (_mm256_movemask_ps(valid) != 0)
+				return true;
+		}
+		return false;
+#else
+		float t = htmax, u, v;
+		for (int i = begin; i < end; i++)
+			if (intersect(ray, i, i + 1, t, u, v) != -1)
+				return true;
+		return false;
+#endif
+	}
+};
+
+// Bottom level of the two level BVH : a mesh with its own BVH, shared by all its instances
+struct MeshBVH
+{
+	string filename;				//!< fichier .obj du maillage.
+	Mesh mesh;						//!< maillage et matieres.
+	vector<BVHNode> nodes;
+	vector<Triangle> triangles;		//!< triangles dans le repere de l'objet, dans l'ordre des feuilles.
+	TriangleSoA soa;
+};
+struct Instance
+{
+	int meshId;
+	Transform model;				//!< passage du repere de l'objet au repere de la scene.
+	Transform inverse;				//!< passage du repere de la scene au repere de l'objet.
+	Transform normalMatrix;			//!< transformation des normales vers le repere de la scene.
+
+	Instance() : meshId(-1) {}
+	Instance(const int id, const Transform& m) : meshId(id), model(m), inverse(m.inverse()), normalMatrix(m.normal()) {}
 };
 
 // Global variables
@@ -172,30 +720,20 @@ vector<Source> sources;
 vector<Triangle> triangles;
 vector<Primitive> primitives;
 vector<BVHNode> bvh;
+vector<QBVHNode> qbvh;
+vector<CompressedQBVHNode> compressedQbvh;
+vector<LightNode> lightTree;
+vector<MeshBVH> meshBVHs;
+vector<Instance> instances;
+vector<BVHNode> instanceBVH;
+TriangleSoA triangleSoA;
 int rootNodeId = 0;
 float goldenNumber = (sqrt(5.0f) + 1.0f) / 2.0f;
 
-// Tools
-Point min(const Point& a, const Point& b)
-{
-	return Point(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z));
-}
-Point max(const Point& a, const Point& b)
-{
-	return Point(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z));
-}
-Vector min(const Vector& a, const Vector& b)
-{
-	return Vector(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z));
-}
-Vector max(const Vector& a, const Vector& b)
-{
-	return Vector(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z));
-}
-
 
 // recuperer les sources de lumiere du mesh : triangles associee a une matiere qui emet de la lumiere, material.emission != 0
-int build_sources(const Mesh& mesh)
+// les sources d'un maillage instancie sont placees dans la scene par la transformation model.
+int build_sources(const Mesh& mesh, const Transform& model = Identity())
 {
 	for (int i = 0; i < mesh.triangle_count(); i++)
 	{
@@ -203,302 +741,4208 @@ int build_sources(const Mesh& mesh)
 		Material material = mesh.triangle_material(i);
 
 		if ((material.emission.r + material.emission.g + material.emission.b) > 0)
+		{
 			// inserer la source de lumiere dans l'ensemble.
-			sources.push_back(Source(mesh.triangle(i), material.emission));
+			TriangleData data = mesh.triangle(i);
+			Point a = model(Point(data.a)), b = model(Point(data.b)), c = model(Point(data.c));
+			data.a = vec3(a.x, a.y, a.z);
+			data.b = vec3(b.x, b.y, b.z);
+			data.c = vec3(c.x, c.y, c.z);
+			sources.push_back(Source(data, material.emission, i));
+		}
 	}
 
 	printf("%d sources.\n", (int)sources.size());
 	return (int)sources.size();
 }
 
-// verifie que le rayon touche une source de lumiere.
-bool direct(const Ray& ray)
+Primitive make_primitive(const Triangle& t, const int triangleId)
 {
-	for (size_t i = 0; i < sources.size(); i++)
-	{
-		float t, u, v;
-		if (sources[i].intersect(ray, ray.tmax, t, u, v))
-			return true;
-	}
-
-	return false;
+	Primitive p;
+	p.bounds.minPoint = min(min(Point(t.a), Point(t.b)), Point(t.c));
+	p.bounds.maxPoint = max(max(Point(t.a), Point(t.b)), Point(t.c));
+	p.center = Point((Vector(p.bounds.maxPoint) + Vector(p.bounds.minPoint)) / 2.0f);
+	p.triangleId = triangleId;
+	return p;
 }
 
 // recuperer les triangles du mesh
-int build_triangles(const Mesh &mesh)
+int build_triangles(const Mesh &mesh, vector<Triangle>& triangles, vector<Primitive>& primitives)
 {
+	int offset = (int)triangles.size();
+	triangles.resize(offset + mesh.triangle_count());
+	primitives.resize(offset + mesh.triangle_count());
+
+#pragma omp parallel for schedule(static)
 	for (int i = 0; i < mesh.triangle_count(); i++)
 	{
-		Triangle t(mesh.triangle(i));
-		triangles.push_back(t);
-
-		Primitive p;
-		p.bounds.minPoint = min(min(Point(t.a), Point(t.b)), Point(t.c));
-		p.bounds.maxPoint = max(max(Point(t.a), Point(t.b)), Point(t.c));
-		p.center = Point((Vector(p.bounds.maxPoint) + Vector(p.bounds.minPoint)) / 2.0f);
-		p.triangleId = i;
-
-		primitives.push_back(p);
+		Triangle t(mesh.triangle(i), i);
+		triangles[offset + i] = t;
+		primitives[offset + i] = make_primitive(t, offset + i);
 	}
 	printf("%d triangles.\n", (int)triangles.size());
 	printf("%d primitives.\n", (int)primitives.size());
 	return (int)triangles.size();
 }
 
+int build_triangles(const Mesh &mesh)
+{
+	return build_triangles(mesh, triangles, primitives);
+}
+
+
+// copie les triangles dans la structure de l'intersection 8 par 8, dans le meme ordre
+void build_triangle_soa(TriangleSoA& soa, const vector<Triangle>& triangles)
+{
+	// 8 padding triangles, degenerated, never intersected
+	size_t size = triangles.size() + 8;
+	vector<float>* arrays[9] = { &soa.ax, &soa.ay, &soa.az, &soa.abx, &soa.aby, &soa.abz, &soa.acx, &soa.acy, &soa.acz };
+	for (int k = 0; k < 9; k++)
+		arrays[k]->assign(size, 0.0f);
+	soa.count = (int)triangles.size();
+
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < (int)triangles.size(); i++)
+	{
+		const Triangle& t = triangles[i];
+		Vector ab = Vector(Point(t.a), Point(t.b));
+		Vector ac = Vector(Point(t.a), Point(t.c));
+		soa.ax[i] = t.a.x; soa.ay[i] = t.a.y; soa.az[i] = t.a.z;
+		soa.abx[i] = ab.x; soa.aby[i] = ab.y; soa.abz[i] = ab.z;
+		soa.acx[i] = ac.x; soa.acy[i] = ac.y; soa.acz[i] = ac.z;
+	}
+}
 
 // calcule l'intersection d'un rayon et de tous les triangles
 bool intersect(const Ray& ray, Hit& hit)
 {
 	hit.t = ray.tmax;
-	for (size_t i = 0; i < triangles.size(); i++)
-	{
-		float t, u, v;
-		if (triangles[i].intersect(ray, hit.t, t, u, v))
-		{
-			hit.t = t;
-			hit.u = u;
-			hit.v = v;
+	int id = triangleSoA.intersect(ray, 0, triangleSoA.count, hit.t, hit.u, hit.v);
+	if (id == -1)
+		return false;
 
-			hit.p = ray(t);	// evalue la positon du point d'intersection sur le rayon
-			hit.n = triangles[i].normal(u, v);
-
-			hit.object_id = i;	// permet de retrouver toutes les infos associees au triangle
-		}
-	}
+	hit.p = ray(hit.t);	// evalue la positon du point d'intersection sur le rayon
+	hit.n = triangles[id].normal(hit.u, hit.v);
 
-	return (hit.object_id != -1);
+	hit.object_id = triangles[id].id;	// permet de retrouver toutes les infos associees au triangle
+	return true;
 }
 
 // Intersect scene using BVH
-bool intersect(const Ray& ray, Hit& hit, int bvhId)
+// Iterative traversal of the depth first node array : the nearest child is visited first,
+// the farthest is pushed on the stack with its entry distance and skipped if a closer hit was found since
+const int BVH_STACK_SIZE = 128;
+// Depth from which the builders split at the median of the centers : the subtree below is balanced, at most 32 levels
+// for 2^32 primitives, and the tree always fits in the traversal stacks
+const int BVH_MEDIAN_DEPTH = BVH_STACK_SIZE - 32;
+
+struct BVHStackEntry
+{
+	int nodeId;
+	float tmin;
+};
+
+//! renvoie l'indice de la primitive la plus proche touchee par le rayon dans le BVH de racine rootId, ou -1.
+//! leaf(node, hit) teste les primitives d'une feuille, renvoie l'indice de la plus proche ou -1, et met a jour hit.
+template <typename LeafIntersect>
+int intersect_nodes(const vector<BVHNode>& nodes, const int rootId, const Ray& ray, Hit& hit, const LeafIntersect& leaf)
 {
+	Vector invd = Vector(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
 	float entryT, exitT;
-	BVHNode node = bvh[bvhId];
+	RAY_STAT(rayStats.boxes++);
+	if (nodes[rootId].aabb.intersect(ray, invd, hit.t, entryT, exitT) == false)
+		return -1;
 
-	// Intersect leaf node
-	if (node.triangleId != -1)
+	BVHStackEntry stack[BVH_STACK_SIZE];
+	int top = 0;
+	int nodeId = rootId;
+	int triangleId = -1;
+	while (true)
 	{
-		float v;
-		int id = node.triangleId;
-		if (triangles[id].intersect(ray, hit.t, entryT, exitT, v))
+		const BVHNode& node = nodes[nodeId];
+		RAY_STAT(rayStats.nodes++);
+		if (node.isLeaf())
 		{
-			hit.t = entryT;
-			hit.u = exitT;
-			hit.v = v;
-
-			hit.p = ray(entryT);
-			hit.n = triangles[id].normal(exitT, v);
-
-			hit.object_id = id;
-			return true;
+			// Intersect leaf node, the hit position and normal are evaluated once at the end
+			int id = leaf(node, hit);
+			if (id != -1)
+				triangleId = id;
 		}
 		else
-			return false;
-	}
-
-	// Intersect intermediary node and recursively explore children
-	if (node.aabb.intersect(ray, hit.t, entryT, exitT) == true)
-	{
-		Hit left = hit, right = hit;
-		bool leftHit = intersect(ray, left, node.leftId);
-		bool rightHit = intersect(ray, right, node.rightId);
+		{
+			// Intersect both children, go down the nearest one
+			int leftId = nodeId + 1;
+			int rightId = node.offset;
+			float leftT, rightT;
+			bool leftHit = nodes[leftId].aabb.intersect(ray, invd, hit.t, leftT, exitT);
+			bool rightHit = nodes[rightId].aabb.intersect(ray, invd, hit.t, rightT, exitT);
+			RAY_STAT(rayStats.boxes += 2);
+			if (leftHit && rightHit)
+			{
+				assert(top < BVH_STACK_SIZE);
+				if (leftT <= rightT)
+				{
+					stack[top].nodeId = rightId;
+					stack[top++].tmin = rightT;
+					nodeId = leftId;
+				}
+				else
+				{
+					stack[top].nodeId = leftId;
+					stack[top++].tmin = leftT;
+					nodeId = rightId;
+				}
+				RAY_STAT(rayStats.depth = std::max(rayStats.depth, (unsigned int)top));
+				continue;
+			}
+			if (leftHit || rightHit)
+			{
+				nodeId = leftHit ? leftId : rightId;
+				continue;
+			}
+		}
 
-		if (rightHit && leftHit)
-			hit = right.t < left.t ? right : left;
-		else
-			hit = leftHit ? left : right;
- 		return (rightHit || leftHit);
+		// Pop the next node still in front of the closest hit
+		while (top > 0 && stack[top - 1].tmin > hit.t)
+			top--;
+		if (top == 0)
+			break;
+		nodeId = stack[--top].nodeId;
 	}
-	return false;
-}
 
+	return triangleId;
+}
 
-// rcupre la couleur du triangle touch
-Color hitColor(Mesh& mesh, Hit& hit)
+bool intersect(const Ray& ray, Hit& hit, int bvhId)
 {
-	Material mat = mesh.triangle_material(hit.object_id);
-	return mat.diffuse + mat.emission;
-}
+	int triangleId = intersect_nodes(bvh, bvhId, ray, hit, [&](const BVHNode& node, Hit& h)
+	{
+		return triangleSoA.intersect(ray, node.offset, node.offset + node.triangleCount, h.t, h.u, h.v);
+	});
+	if (triangleId == -1)
+		return false;
 
+	hit.p = ray(hit.t);
+	hit.n = triangles[triangleId].normal(hit.u, hit.v);
+	hit.object_id = triangles[triangleId].id;
+	return true;
+}
 
-// b1, b2, n sont 3 axes orthonormes.
-void branchlessONB(const Vector &n, Vector &b1, Vector &b2)
+// Intersect scene using the 4-wide BVH, QBVHNode or CompressedQBVHNode
+// Same ordered traversal as the binary BVH, the children touched by the ray are pushed farthest first
+struct QBVHStackEntry
 {
-	float sign = std::copysign(1.0f, n.z);
-	const float a = -1.0f / (sign + n.z);
-	const float b = n.x * n.y * a;
-	b1 = Vector(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
-	b2 = Vector(b, sign + n.y * n.y * a, -n.y);
-}
+	int child;
+	int count;
+	float tmin;
+};
 
-// Ambient Occlusion
-float GetAmbientOcclusionTerm(const Hit& origin, const int iterations)
+template <typename QNode>
+bool intersect_qbvh(const vector<QNode>& qnodes, const Ray& ray, Hit& hit)
 {
-	float accumulator = 0.0f;
-	for (int i = 0; i < iterations; i++)
+	Vector invd = Vector(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+	QBVHStackEntry stack[3 * BVH_STACK_SIZE + 1];
+	int top = 0;
+	stack[top].child = 0;
+	stack[top].count = 0;
+	stack[top++].tmin = 0;
+
+	int triangleId = -1;
+	while (top > 0)
 	{
-		// Create fibonnaci vector
-		float u = rand() / (float)RAND_MAX;
-		float phi = 2.0f * M_PI * (((i + u) / goldenNumber) - floor((i + u) / goldenNumber));
-		float cosTheta = 1.0f - ((2.0f * i + 1.0f) / (2.0f * iterations));
-		float sinTheta = sqrt(1.0f - (cosTheta * cosTheta));
-		Vector fiboDir(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+		const QBVHStackEntry entry = stack[--top];
+		if (entry.tmin > hit.t)
+			continue;
+
+		if (entry.count > 0)
+		{
+			// Intersect leaf, the hit position and normal are evaluated once at the end
+			int id = triangleSoA.intersect(ray, entry.child, entry.child + entry.count, hit.t, hit.u, hit.v);
+			if (id != -1)
+				triangleId = id;
+			continue;
+		}
 
-		// Convert to world space
-		Vector tangent, binormal;
-		branchlessONB(origin.n, tangent, binormal);
-		Vector fiboWorldDir(fiboDir.x * tangent + fiboDir.y * binormal + fiboDir.z * origin.n);
+		const QNode& node = qnodes[entry.child];
+		float tmin[4];
+		int mask = node.intersect(ray, invd, hit.t, tmin);
+		RAY_STAT(rayStats.nodes++);
+		RAY_STAT(rayStats.boxes += 4);
+		if (mask == 0)
+			continue;
+
+		// Sort the touched children by decreasing distance, so the nearest one is popped first
+		int order[4];
+		int n = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if ((mask & (1 << i)) == 0)
+				continue;
+			int j = n++;
+			for (; j > 0 && tmin[order[j - 1]] < tmin[i]; j--)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
 
-		// Cast ray
-		Hit hit;
-		Ray ray(origin.p + 0.001f * origin.n, fiboDir);
-		if (intersect(ray, hit, rootNodeId) == false)
-			accumulator += dot(fiboDir, origin.n);
+		for (int i = 0; i < n; i++)
+		{
+			assert(top < 3 * BVH_STACK_SIZE + 1);
+			stack[top].child = node.child[order[i]];
+			stack[top].count = node.count[order[i]];
+			stack[top++].tmin = tmin[order[i]];
+		}
+		RAY_STAT(rayStats.depth = std::max(rayStats.depth, (unsigned int)top));
 	}
-	return accumulator / (float)iterations * M_PI;
+
+	if (triangleId == -1)
+		return false;
+
+	hit.p = ray(hit.t);
+	hit.n = triangles[triangleId].normal(hit.u, hit.v);
+	hit.object_id = triangles[triangleId].id;
+	return true;
 }
 
-// Bounding volume hierarchy
-struct predicat
+// Occlusion queries : stop at the first intersection before tmax, in any order, without evaluating the hit
+// leaf(node) renvoie vrai si une primitive de la feuille cache le segment
+template <typename LeafOccluded>
+bool occluded_nodes(const vector<BVHNode>& nodes, const int rootId, const Ray& ray, const float tmax, const LeafOccluded& leaf)
 {
-	int axe;
+	Vector invd = Vector(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = rootId;
+	while (top > 0)
+	{
+		int nodeId = stack[--top];
+		const BVHNode& node = nodes[nodeId];
+		float entryT, exitT;
+		RAY_STAT(rayStats.nodes++);
+		RAY_STAT(rayStats.boxes++);
+		if (node.aabb.intersect(ray, invd, tmax, entryT, exitT) == false)
+			continue;
+
+		if (node.isLeaf())
+		{
+			if (leaf(node))
+				return true;
+			continue;
+		}
+
+		assert(top + 2 <= BVH_STACK_SIZE);
+		stack[top++] = node.offset;
+		stack[top++] = nodeId + 1;
+		RAY_STAT(rayStats.depth = std::max(rayStats.depth, (unsigned int)top));
+	}
+	return false;
+}
+
+bool occluded(const Ray& ray, const float tmax, int bvhId)
+{
+	return occluded_nodes(bvh, bvhId, ray, tmax, [&](const BVHNode& node)
+	{
+		return triangleSoA.occluded(ray, node.offset, node.offset + node.triangleCount, tmax);
+	});
+}
+
+template <typename QNode>
+bool occluded_qbvh(const vector<QNode>& qnodes, const Ray& ray, const float tmax)
+{
+	Vector invd = Vector(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+	int stack[3 * BVH_STACK_SIZE + 1];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const QNode& node = qnodes[stack[--top]];
+		float tmin[4];
+		int mask = node.intersect(ray, invd, tmax, tmin);
+		RAY_STAT(rayStats.nodes++);
+		RAY_STAT(rayStats.boxes += 4);
+		for (int i = 0; i < 4; i++)
+		{
+			if ((mask & (1 << i)) == 0)
+				continue;
+			if (node.count[i] > 0)
+			{
+				if (triangleSoA.occluded(ray, node.child[i], node.child[i] + node.count[i], tmax))
+					return true;
+			}
+			else
+			{
+				assert(top < 3 * BVH_STACK_SIZE + 1);
+				stack[top++] = node.child[i];
+				RAY_STAT(rayStats.depth = std::max(rayStats.depth, (unsigned int)top));
+			}
+		}
+	}
+	return false;
+}
+
+// Collapse the binary BVH in a 4-wide BVH : the internal child with the largest box is opened
+// until the node has 4 children, or only leaves
+int collapse_qbvh(const vector<BVHNode>& nodes, const int nodeId, vector<QBVHNode>& qnodes)
+{
+	int children[4];
+	int n = 0;
+	if (nodes[nodeId].isLeaf())
+		children[n++] = nodeId;
+	else
+	{
+		children[n++] = nodeId + 1;
+		children[n++] = nodes[nodeId].offset;
+	}
+
+	while (n < 4)
+	{
+		int largest = -1;
+		float largestArea = -1.0f;
+		for (int i = 0; i < n; i++)
+		{
+			if (nodes[children[i]].isLeaf())
+				continue;
+			float area = nodes[children[i]].aabb.area();
+			if (area > largestArea)
+			{
+				largest = i;
+				largestArea = area;
+			}
+		}
+		if (largest == -1)
+			break;
+
+		int opened = children[largest];
+		children[largest] = opened + 1;
+		children[n++] = nodes[opened].offset;
+	}
+
+	int id = (int)qnodes.size();
+	qnodes.push_back(QBVHNode());
+	for (int i = 0; i < n; i++)
+	{
+		const BVHNode& child = nodes[children[i]];
+		if (child.isLeaf())
+			qnodes[id].setChild(i, child.aabb, child.offset, child.triangleCount);
+		else
+		{
+			int c = collapse_qbvh(nodes, children[i], qnodes);
+			qnodes[id].setChild(i, child.aabb, c, 0);
+		}
+	}
+	return id;
+}
+
+void build_qbvh(vector<QBVHNode>& qnodes, const vector<BVHNode>& nodes)
+{
+	qnodes.clear();
+	qnodes.reserve(nodes.size() / 2 + 1);
+	collapse_qbvh(nodes, 0, qnodes);
+	printf("%d QBVH nodes (%dKB).\n", (int)qnodes.size(), (int)(qnodes.size() * sizeof(QBVHNode) / 1024));
+}
+
+// Quantize the nodes of the 4-wide BVH, same layout and same indices
+void build_compressed_qbvh(vector<CompressedQBVHNode>& cnodes, const vector<BVHNode>& nodes)
+{
+	vector<QBVHNode> qnodes;
+	qnodes.reserve(nodes.size() / 2 + 1);
+	collapse_qbvh(nodes, 0, qnodes);
+
+	cnodes.clear();
+	cnodes.reserve(qnodes.size());
+	for (size_t i = 0; i < qnodes.size(); i++)
+		cnodes.push_back(CompressedQBVHNode(qnodes[i]));
+	printf("%d compressed QBVH nodes (%dKB).\n", (int)cnodes.size(), (int)(cnodes.size() * sizeof(CompressedQBVHNode) / 1024));
+}
+
+// Two level BVH
+// The meshes are stored once with their own BVH, and placed in the scene by instances. The top level BVH is built over
+// the bounds of the instances, its leaves transform the ray in the space of the mesh of each instance. The transform is
+// linear, the abscissa t of a hit is the same in both spaces and the hits of different instances are compared directly.
+bool intersect_instances(const Ray& ray, Hit& hit)
+{
+	if (instanceBVH.empty())
+		return false;
+
+	int triangleId = -1;
+	int instanceId = intersect_nodes(instanceBVH, 0, ray, hit, [&](const BVHNode& node, Hit& h)
+	{
+		int closest = -1;
+		for (int i = node.offset; i < node.offset + node.triangleCount; i++)
+		{
+			const Instance& instance = instances[i];
+			const MeshBVH& mesh = meshBVHs[instance.meshId];
+			Ray local(instance.inverse(ray.o), instance.inverse(ray.d));
+			int id = intersect_nodes(mesh.nodes, 0, local, h, [&](const BVHNode& leaf, Hit& lh)
+			{
+				return mesh.soa.intersect(local, leaf.offset, leaf.offset + leaf.triangleCount, lh.t, lh.u, lh.v);
+			});
+			if (id != -1)
+			{
+				closest = i;
+				triangleId = id;
+			}
+		}
+		return closest;
+	});
+	if (instanceId == -1)
+		return false;
+
+	const Instance& instance = instances[instanceId];
+	const Triangle& triangle = meshBVHs[instance.meshId].triangles[triangleId];
+	hit.p = ray(hit.t);
+	hit.n = normalize(instance.normalMatrix(triangle.normal(hit.u, hit.v)));
+	hit.object_id = triangle.id;
+	hit.instance_id = instanceId;
+	return true;
+}
+
+bool occluded_instances(const Ray& ray, const float tmax)
+{
+	if (instanceBVH.empty())
+		return false;
+
+	return occluded_nodes(instanceBVH, 0, ray, tmax, [&](const BVHNode& node)
+	{
+		for (int i = node.offset; i < node.offset + node.triangleCount; i++)
+		{
+			const Instance& instance = instances[i];
+			const MeshBVH& mesh = meshBVHs[instance.meshId];
+			Ray local(instance.inverse(ray.o), instance.inverse(ray.d));
+			bool hidden = occluded_nodes(mesh.nodes, 0, local, tmax, [&](const BVHNode& leaf)
+			{
+				return mesh.soa.occluded(local, leaf.offset, leaf.offset + leaf.triangleCount, tmax);
+			});
+			if (hidden)
+				return true;
+		}
+		return false;
+	});
+}
+
+// renvoie le maillage du triangle touche : celui de l'instance touchee, ou le maillage de la scene.
+Mesh& hit_mesh(Mesh& scene, const Hit& hit)
+{
+	if (hit.instance_id == -1)
+		return scene;
+	return meshBVHs[instances[hit.instance_id].meshId].mesh;
+}
+
+// Intersect scene using the selected acceleration structure
+enum BVHTraversal { TRAVERSAL_BVH2, TRAVERSAL_QBVH, TRAVERSAL_QBVH_COMPRESSED, TRAVERSAL_INSTANCES };
+BVHTraversal traversal = TRAVERSAL_BVH2;
+
+bool intersect_scene(const Ray& ray, Hit& hit)
+{
+	RAY_STAT(rayStats.rays++);
+	if (traversal == TRAVERSAL_INSTANCES)
+		return intersect_instances(ray, hit);
+	if (traversal == TRAVERSAL_QBVH)
+		return intersect_qbvh(qbvh, ray, hit);
+	if (traversal == TRAVERSAL_QBVH_COMPRESSED)
+		return intersect_qbvh(compressedQbvh, ray, hit);
+	return intersect(ray, hit, rootNodeId);
+}
+
+// Visibility of the segment [0 .. tmax] of the ray, for shadow and ambient occlusion rays
+bool occluded(const Ray& ray, const float tmax)
+{
+	RAY_STAT(rayStats.rays++);
+	if (traversal == TRAVERSAL_INSTANCES)
+		return occluded_instances(ray, tmax);
+	if (traversal == TRAVERSAL_QBVH)
+		return occluded_qbvh(qbvh, ray, tmax);
+	if (traversal == TRAVERSAL_QBVH_COMPRESSED)
+		return occluded_qbvh(compressedQbvh, ray, tmax);
+	return occluded(ray, tmax, rootNodeId);
+}
+
+// Light hierarchy over the sources, cf "Importance Sampling of Many Lights with Adaptive Tree Splitting", Estevez & Kulla
+// The sources are split at the median of the longest axis of their centers, the tree is balanced and a source is chosen
+// by a single descent : each child is selected proportionally to its estimated contribution to the shaded point.
+float source_power(const Source& source)
+{
+	Vector n = cross(Vector(Point(source.a), Point(source.b)), Vector(Point(source.a), Point(source.c)));
+	float area = length(n) / 2.0f;
+	return (source.emission.r + source.emission.g + source.emission.b) / 3.0f * area;
+}
+
+Point source_center(const Source& source)
+{
+	return Point((Vector(source.a) + Vector(source.b) + Vector(source.c)) / 3.0f);
+}
+
+int build_light_nodes(vector<LightNode>& nodes, vector<Source>& sources, const int begin, const int end)
+{
+	AABB bounds = AABB::empty();
+	AABB centers = AABB::empty();
+	float power = 0.0f;
+	for (int i = begin; i < end; i++)
+	{
+		bounds.grow(Point(sources[i].a));
+		bounds.grow(Point(sources[i].b));
+		bounds.grow(Point(sources[i].c));
+		centers.grow(source_center(sources[i]));
+		power += source_power(sources[i]);
+	}
+
+	int nodeId = (int)nodes.size();
+	nodes.push_back(LightNode(bounds, power, begin, 1));
+	if (end - begin == 1)
+		return nodeId;
+
+	Vector extent(centers.minPoint, centers.maxPoint);
+	float maxValue = max(max(extent.x, extent.y), extent.z);
+	int axe = (maxValue == extent.x) ? 0 : (maxValue == extent.y) ? 1 : 2;
+	int mid = (begin + end) / 2;
+	std::nth_element(sources.begin() + begin, sources.begin() + mid, sources.begin() + end,
+		[axe](const Source& a, const Source& b) { return source_center(a)(axe) < source_center(b)(axe); });
+
+	build_light_nodes(nodes, sources, begin, mid);
+	int right = build_light_nodes(nodes, sources, mid, end);
+	nodes[nodeId].offset = right;
+	nodes[nodeId].sourceCount = 0;
+	return nodeId;
+}
+
+// reordonne les sources dans l'ordre des feuilles
+int build_light_tree(vector<LightNode>& nodes, vector<Source>& sources)
+{
+	nodes.clear();
+	if (sources.empty())
+		return 0;
+
+	nodes.reserve(2 * sources.size() - 1);
+	build_light_nodes(nodes, sources, 0, (int)sources.size());
+	printf("%d light nodes.\n", (int)nodes.size());
+	return (int)nodes.size();
+}
+
+// Estimated contribution of a node to the point p of normal n : its power divided by the squared distance to its center,
+// bounded by the size of the node when p is close or inside. The nodes entirely behind the surface contribute nothing.
+float light_importance(const LightNode& node, const Point& p, const Vector& n)
+{
+	Point corner(n.x > 0 ? node.aabb.maxPoint.x : node.aabb.minPoint.x,
+		n.y > 0 ? node.aabb.maxPoint.y : node.aabb.minPoint.y,
+		n.z > 0 ? node.aabb.maxPoint.z : node.aabb.minPoint.z);
+	if (dot(Vector(p, corner), n) <= 0.0f)
+		return 0.0f;
+
+	float distance2 = length2(Vector(p, node.aabb.center()));
+	float radius2 = length2(Vector(node.aabb.minPoint, node.aabb.maxPoint)) / 4.0f;
+	return node.power / std::max(distance2, radius2);
+}
+
+//! choisit une source proportionnellement a sa contribution estimee au point p, renvoie son indice et la probabilite de la choisir, ou -1.
+int sample_light(const Point& p, const Vector& n, float u, float& pdf)
+{
+	pdf = 1.0f;
+	if (lightTree.empty())
+		return -1;
+
+	int nodeId = 0;
+	while (lightTree[nodeId].isLeaf() == false)
+	{
+		int leftId = nodeId + 1;
+		int rightId = lightTree[nodeId].offset;
+		float leftWeight = light_importance(lightTree[leftId], p, n);
+		float rightWeight = light_importance(lightTree[rightId], p, n);
+		if (leftWeight + rightWeight <= 0.0f)
+			return -1;
+
+		// reuse the random number to descend in the selected child
+		float pLeft = leftWeight / (leftWeight + rightWeight);
+		if (u < pLeft)
+		{
+			u = std::min(u / pLeft, 0.99999994f);
+			pdf *= pLeft;
+			nodeId = leftId;
+		}
+		else
+		{
+			u = std::min((u - pLeft) / (1.0f - pLeft), 0.99999994f);
+			pdf *= 1.0f - pLeft;
+			nodeId = rightId;
+		}
+	}
+	return lightTree[nodeId].offset;
+}
+
+// verifie que le rayon touche une source de lumiere, en parcourant la hierarchie des sources.
+bool direct(const Ray& ray)
+{
+	if (lightTree.empty())
+		return false;
+
+	Vector invd = Vector(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const LightNode& node = lightTree[stack[--top]];
+		float entryT, exitT;
+		if (node.aabb.intersect(ray, invd, ray.tmax, entryT, exitT) == false)
+			continue;
+
+		if (node.isLeaf())
+		{
+			float t, u, v;
+			if (sources[node.offset].intersect(ray, ray.tmax, t, u, v))
+				return true;
+		}
+		else
+		{
+			assert(top + 2 <= BVH_STACK_SIZE);
+			stack[top++] = node.offset;
+			stack[top++] = &node - lightTree.data() + 1;
+		}
+	}
+	return false;
+}
+
+// Coherent packets of primary rays, traced together through the binary BVH
+// A node is entered by the packet from the first ray that touches it, the rays before it are inactive in the subtree.
+// If the first active ray misses a box, an interval test on the whole packet culls it before the remaining rays are tested.
+const int PACKET_SIZE = 8;		// packets of 8x8 pixels
+const int PACKET_RAYS = PACKET_SIZE * PACKET_SIZE;
+
+struct RayPacket
+{
+	Ray rays[PACKET_RAYS];
+	Vector invd[PACKET_RAYS];
+	int count = 0;
+
+	// Bounds of the packet : intervals of the origins and of the inverse directions, valid only for a coherent packet
+	Point omin, omax;
+	Vector invdMin, invdMax;
+	Vector direction;
+	bool coherent = false;
+
+	void add(const Ray& ray)
+	{
+		rays[count++] = ray;
+	}
+
+	//! calcule les bornes du paquet, un paquet est coherent si les directions de tous les rayons ont le meme signe sur les 3 axes.
+	void update()
+	{
+		const float large = 1e30f;
+		omin = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+		omax = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		invdMin = Vector(FLT_MAX, FLT_MAX, FLT_MAX);
+		invdMax = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		direction = Vector();
+		for (int i = 0; i < count; i++)
+		{
+			invd[i] = Vector(1.f / rays[i].d.x, 1.f / rays[i].d.y, 1.f / rays[i].d.z);
+			Vector clamped = max(min(invd[i], Vector(large, large, large)), Vector(-large, -large, -large));
+			omin = min(omin, rays[i].o);
+			omax = max(omax, rays[i].o);
+			invdMin = min(invdMin, clamped);
+			invdMax = max(invdMax, clamped);
+			direction = direction + rays[i].d;
+		}
+
+		coherent = count > 0;
+		for (int axe = 0; axe < 3; axe++)
+			coherent = coherent && (std::signbit(invdMin(axe)) == std::signbit(invdMax(axe)));
+	}
+
+	//! test conservatif : renvoie faux si aucun rayon du paquet ne peut toucher la boite avant htmax.
+	bool intersect(const AABB& box, const float htmax) const
+	{
+		float tnear = 0.0f;
+		float tfar = htmax;
+		for (int axe = 0; axe < 3; axe++)
+		{
+			bool negative = invdMin(axe) < 0.0f;
+			float nearPlane = negative ? box.maxPoint(axe) : box.minPoint(axe);
+			float farPlane = negative ? box.minPoint(axe) : box.maxPoint(axe);
+
+			// interval of (plane - o) * invd over the packet, the lower bound for the near plane, the upper bound for the far plane
+			float n0 = nearPlane - omax(axe), n1 = nearPlane - omin(axe);
+			float f0 = farPlane - omax(axe), f1 = farPlane - omin(axe);
+			float i0 = invdMin(axe), i1 = invdMax(axe);
+			tnear = std::max(tnear, std::min(std::min(n0 * i0, n0 * i1), std::min(n1 * i0, n1 * i1)));
+			tfar = std::min(tfar, std::max(std::max(f0 * i0, f0 * i1), std::max(f1 * i0, f1 * i1)));
+		}
+		return tnear <= tfar;
+	}
+};
+
+// Index of the first ray of the packet, from first, that touches the box, count if none
+int packet_first_hit(const RayPacket& packet, const Hit hits[], const AABB& box, const int first, const float maxT)
+{
+	float entryT, exitT;
+	RAY_STAT(rayStats.boxes++);
+	if (box.intersect(packet.rays[first], packet.invd[first], hits[first].t, entryT, exitT))
+		return first;
+	RAY_STAT(rayStats.boxes++);
+	if (packet.intersect(box, maxT) == false)
+		return packet.count;
+
+	for (int i = first + 1; i < packet.count; i++)
+	{
+		RAY_STAT(rayStats.boxes++);
+		if (box.intersect(packet.rays[i], packet.invd[i], hits[i].t, entryT, exitT))
+			return i;
+	}
+	return packet.count;
+}
+
+// Intersect scene with all the rays of the packet, traced one by one if the packet is not coherent
+void intersect_packet(RayPacket& packet, Hit hits[])
+{
+	packet.update();
+	for (int i = 0; i < packet.count; i++)
+	{
+		hits[i] = Hit();
+		hits[i].t = packet.rays[i].tmax;
+	}
+
+	if (packet.coherent == false)
+	{
+		for (int i = 0; i < packet.count; i++)
+			intersect_scene(packet.rays[i], hits[i]);
+		return;
+	}
+
+	RAY_STAT(rayStats.rays += packet.count);
+	int triangleIds[PACKET_RAYS];
+	float maxT = 0.0f;
+	for (int i = 0; i < packet.count; i++)
+	{
+		triangleIds[i] = -1;
+		maxT = std::max(maxT, hits[i].t);
+	}
+
+	struct { int nodeId; int first; } stack[BVH_STACK_SIZE];
+	int top = 0;
+	int nodeId = rootNodeId;
+	int first = packet_first_hit(packet, hits, bvh[nodeId].aabb, 0, maxT);
+	if (first == packet.count)
+		return;
+
+	while (true)
+	{
+		const BVHNode& node = bvh[nodeId];
+		RAY_STAT(rayStats.nodes++);
+		if (node.isLeaf())
+		{
+			// Intersect the leaf triangles with the active rays, and update the farthest hit of the packet
+			maxT = 0.0f;
+			for (int i = 0; i < packet.count; i++)
+			{
+				if (i >= first)
+				{
+					int id = triangleSoA.intersect(packet.rays[i], node.offset, node.offset + node.triangleCount, hits[i].t, hits[i].u, hits[i].v);
+					if (id != -1)
+						triangleIds[i] = id;
+				}
+				maxT = std::max(maxT, hits[i].t);
+			}
+		}
+		else
+		{
+			int leftId = nodeId + 1;
+			int rightId = node.offset;
+			int leftFirst = packet_first_hit(packet, hits, bvh[leftId].aabb, first, maxT);
+			int rightFirst = packet_first_hit(packet, hits, bvh[rightId].aabb, first, maxT);
+			if (leftFirst < packet.count && rightFirst < packet.count)
+			{
+				// Visit first the child in front along the mean direction of the packet
+				Vector axis = bvh[rightId].aabb.center() - bvh[leftId].aabb.center();
+				bool leftNear = dot(axis, packet.direction) >= 0.0f;
+				assert(top < BVH_STACK_SIZE);
+				stack[top].nodeId = leftNear ? rightId : leftId;
+				stack[top++].first = leftNear ? rightFirst : leftFirst;
+				RAY_STAT(rayStats.depth = std::max(rayStats.depth, (unsigned int)top));
+				nodeId = leftNear ? leftId : rightId;
+				first = leftNear ? leftFirst : rightFirst;
+				continue;
+			}
+			if (leftFirst < packet.count || rightFirst < packet.count)
+			{
+				nodeId = leftFirst < packet.count ? leftId : rightId;
+				first = std::min(leftFirst, rightFirst);
+				continue;
+			}
+		}
+
+		// Pop the next node still touched by the packet, the closest hits may have changed since it was pushed
+		first = packet.count;
+		while (top > 0 && first == packet.count)
+		{
+			top--;
+			nodeId = stack[top].nodeId;
+			first = packet_first_hit(packet, hits, bvh[nodeId].aabb, stack[top].first, maxT);
+		}
+		if (first == packet.count)
+			break;
+	}
+
+	for (int i = 0; i < packet.count; i++)
+	{
+		if (triangleIds[i] == -1)
+			continue;
+		hits[i].p = packet.rays[i](hits[i].t);
+		hits[i].n = triangles[triangleIds[i]].normal(hits[i].u, hits[i].v);
+		hits[i].object_id = triangles[triangleIds[i]].id;
+	}
+}
+
+
+// récupère la couleur du triangle touché
+Color hitColor(Mesh& mesh, const Hit& hit)
+{
+	Material mat = mesh.triangle_material(hit.object_id);
+	return mat.diffuse + mat.emission;
+}
+
+
+// b1, b2, n sont 3 axes orthonormes.
+void branchlessONB(const Vector &n, Vector &b1, Vector &b2)
+{
+	float sign = std::copysign(1.0f, n.z);
+	const float a = -1.0f / (sign + n.z);
+	const float b = n.x * n.y * a;
+	b1 = Vector(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+	b2 = Vector(b, sign + n.y * n.y * a, -n.y);
+}
+
+// Ambient Occlusion
+// With the random sampler, the directions follow a jittered fibonacci spiral of iterations directions, the low discrepancy
+// samplers give the 2 coordinates of the direction on the sphere. When the number of directions is unknown (iterations = 0),
+// the random sampler draws uniform directions.
+Vector GetAmbientOcclusionDirection(const int i, const int iterations, Sampler& sampler)
+{
+	float phi, cosTheta;
+	if (sampler.type() == SAMPLER_RANDOM && iterations > 0)
+	{
+		// Create fibonnaci vector
+		float u = sampler.uniform();
+		phi = 2.0f * M_PI * (((i + u) / goldenNumber) - floor((i + u) / goldenNumber));
+		cosTheta = 1.0f - ((2.0f * i + 1.0f) / (2.0f * iterations));
+	}
+	else
+	{
+		float u, v;
+		sampler.sample2D(i, u, v);
+		phi = 2.0f * M_PI * u;
+		cosTheta = 1.0f - 2.0f * v;
+	}
+	float sinTheta = sqrt(1.0f - (cosTheta * cosTheta));
+	// the directions are used in world space, over the whole sphere, see GetCosineOcclusionSample() for the hemisphere of the normal
+	return Vector(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+}
+
+float GetAmbientOcclusionSample(const Hit& origin, const int i, const int iterations, Sampler& sampler)
+{
+	Vector fiboDir = GetAmbientOcclusionDirection(i, iterations, sampler);
+
+	// Cast ray
+	Ray ray(origin.p + 0.001f * origin.n, fiboDir);
+	if (occluded(ray, ray.tmax))
+		return 0.0f;
+	return dot(fiboDir, origin.n) * M_PI;
+}
+
+// Cosine weighted ambient occlusion
+// The directions come from a table built once : the R2 sequence mapped to the cosine weighted hemisphere, so the first
+// directions of the table are well distributed for any number of samples. Each pixel rotates the table around its normal by
+// a random angle, the frame is built once per pixel. The pdf of the directions cancels the cosine, the estimate is the
+// fraction of the directions not occluded before aoRadius.
+// AO_CACHE evaluates the same estimate at sparse records and interpolates it, cf AOCache.
+enum AOMode { AO_LEGACY, AO_COSINE, AO_CACHE };
+AOMode aoMode = AO_LEGACY;
+float aoRadius = 1.0f;
+vector<Vector> aoDirections;
+
+void build_ao_directions(const int count)
+{
+	const double g = 1.32471795724474602596;
+	aoDirections.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		double u = 0.5 + i / g;
+		double v = 0.5 + i / (g * g);
+		u -= floor(u);
+		v -= floor(v);
+		float r = (float)sqrt(u);
+		float phi = (float)(2.0 * M_PI * v);
+		aoDirections[i] = Vector(r * cos(phi), r * sin(phi), (float)sqrt(1.0 - u));
+	}
+}
+
+struct AOFrame
+{
+	Point origin;	//!< origine des rayons, decalee le long de la normale.
+	Vector t, b, n;	//!< repere du pixel, tourne autour de la normale.
+};
+
+AOFrame make_ao_frame(const Hit& hit, Sampler& sampler)
+{
+	AOFrame frame;
+	frame.origin = hit.p + 0.001f * hit.n;
+	frame.n = normalize(hit.n);
+	Vector tangent, binormal;
+	branchlessONB(frame.n, tangent, binormal);
+	float angle = 2.0f * (float)M_PI * sampler.uniform();
+	float c = cos(angle), s = sin(angle);
+	frame.t = c * tangent + s * binormal;
+	frame.b = c * binormal - s * tangent;
+	return frame;
+}
+
+Vector GetCosineOcclusionDirection(const AOFrame& frame, const int i)
+{
+	assert(i < (int)aoDirections.size());
+	const Vector& d = aoDirections[i];
+	return d.x * frame.t + d.y * frame.b + d.z * frame.n;
+}
+
+float GetCosineOcclusionSample(const AOFrame& frame, const int i)
+{
+	Ray ray(frame.origin, GetCosineOcclusionDirection(frame, i));
+	float tmax = aoRadius > 0.0f ? aoRadius : FLT_MAX;
+	return occluded(ray, tmax) ? 0.0f : 1.0f;
+}
+
+// Ambient occlusion cache, cf "A Ray Tracing Solution for Diffuse Interreflection", Ward, Rubinstein & Clear, 1988
+// and "Irradiance Gradients", Ward & Heckbert, 1992
+// A record samples the whole hemisphere of a shading point with M x N cosine weighted strata, it stores the cosine
+// weighted occlusion, the harmonic mean distance to the occluders and the rotation and translation gradients of the
+// occlusion. The other shading points interpolate the records closer than their error estimate, a new record is only
+// computed when none is close enough. The records are stored in an octree, each record is linked in every node of the
+// level matching its radius of validity that overlaps its sphere of validity, a lookup only visits the nodes containing
+// the shading point, from the root to the leaf.
+// The octree is shared by the threads without locks : the nodes and the lists of records are only appended with a
+// compare and swap, the readers see a list either before or after the insertion of a record.
+// The result depends on the order the records are created, so on the number of threads.
+const float AO_CACHE_MIN_SPACING = 1.0f / 16.0f;	// minimum radius of the records, relative to the maximum radius
+const int AO_CACHE_MAX_DEPTH = 20;
+
+float aoCacheError = 0.2f;		// error tolerance a of the interpolation, the larger the fewer records
+
+struct AORecord
+{
+	Point p;					//!< position.
+	Vector n;					//!< normale.
+	float ao;					//!< occultation ambiante ponderee par le cosinus.
+	float radius;				//!< distance harmonique moyenne aux occultants, bornee par l'espacement min et max des records.
+	Vector rotation;			//!< gradient de rotation de l'occultation.
+	Vector translation;			//!< gradient de translation de l'occultation.
+	AORecord *next = nullptr;	//!< record cree avant celui-ci, liste de tous les records du cache.
+};
+
+struct AORecordLink
+{
+	const AORecord *record;
+	AORecordLink *next;
+};
+
+struct AOCacheNode
+{
+	std::atomic<AOCacheNode *> children[8];
+	std::atomic<AORecordLink *> records;
+
+	AOCacheNode() : records(nullptr)
+	{
+		for (int i = 0; i < 8; i++)
+			children[i] = nullptr;
+	}
+
+	~AOCacheNode()
+	{
+		for (int i = 0; i < 8; i++)
+			delete children[i].load();
+		for (AORecordLink *link = records.load(); link != nullptr;)
+		{
+			AORecordLink *next = link->next;
+			delete link;
+			link = next;
+		}
+	}
+};
+
+// Statistics of the lookups of a thread, in its own cache line
+struct AOCacheCounters
+{
+	int lookups = 0;
+	int hits = 0;
+	char padding[64 - 2 * sizeof(int)];
+};
+
+class AOCache
+{
+public:
+	//! cache sur le cube englobant bounds, maxSpacing est le rayon max des records.
+	AOCache(const AABB& bounds, const float maxSpacing)
+		: m_maxSpacing(maxSpacing), m_records(nullptr), m_count(0), m_id(next_id()++)
+	{
+		Vector e(bounds.minPoint, bounds.maxPoint);
+		m_size = std::max(e.x, std::max(e.y, e.z)) * 1.01f + 1e-4f;
+		m_min = bounds.center() - Vector(m_size, m_size, m_size) / 2.0f;
+	}
+
+	~AOCache()
+	{
+		for (AORecord *record = m_records.load(); record != nullptr;)
+		{
+			AORecord *next = record->next;
+			delete record;
+			record = next;
+		}
+	}
+
+	float minSpacing() const { return m_maxSpacing * AO_CACHE_MIN_SPACING; }
+	float maxSpacing() const { return m_maxSpacing; }
+
+	//! interpole l'occultation des records valides en p, renvoie false si aucun record n'est assez proche.
+	bool lookup(const Point& p, const Vector& n, float& ao)
+	{
+		AOCacheCounters& stats = counters();
+		stats.lookups++;
+		float weights = 0.0f;
+		float sum = 0.0f;
+		Point nodeMin = m_min;
+		float size = m_size;
+		const AOCacheNode *node = &m_root;
+		while (node != nullptr)
+		{
+			for (const AORecordLink *link = node->records.load(); link != nullptr; link = link->next)
+			{
+				const AORecord& record = *link->record;
+				Vector d(record.p, p);
+				// the record is in front of p
+				if (dot(d, n + record.n) < -0.02f * record.radius)
+					continue;
+				float error = length(d) / record.radius + sqrt(std::max(1.0f - dot(n, record.n), 0.0f));
+				if (error >= aoCacheError)
+					continue;
+
+				// the weight falls to 0 at the tolerance, the record is extrapolated with its gradients
+				float w = 1.0f / std::max(error, 1e-4f) - 1.0f / aoCacheError;
+				float value = record.ao + dot(cross(record.n, n), record.rotation) + dot(d, record.translation);
+				sum += w * std::min(std::max(value, 0.0f), 1.0f);
+				weights += w;
+			}
+
+			size /= 2.0f;
+			int child = 0;
+			if (p.x >= nodeMin.x + size) { child |= 1; nodeMin.x += size; }
+			if (p.y >= nodeMin.y + size) { child |= 2; nodeMin.y += size; }
+			if (p.z >= nodeMin.z + size) { child |= 4; nodeMin.z += size; }
+			node = node->children[child].load();
+		}
+
+		if (weights <= 0.0f)
+			return false;
+		stats.hits++;
+		ao = sum / weights;
+		return true;
+	}
+
+	//! insere un record, le cache en devient proprietaire.
+	void insert(AORecord *record)
+	{
+		record->next = m_records.load();
+		while (m_records.compare_exchange_weak(record->next, record) == false)
+			continue;
+		m_count++;
+
+		float validity = record->radius * aoCacheError;
+		AABB bounds(record->p - Vector(validity, validity, validity), record->p + Vector(validity, validity, validity));
+		insert(m_root, m_min, m_size, 0, record, bounds, validity);
+	}
+
+	int records() const { return m_count; }
+
+	//! renvoie la somme des compteurs des threads, apres le rendu.
+	int lookups()
+	{
+		std::lock_guard<std::mutex> lock(m_countersMutex);
+		int n = 0;
+		for (size_t i = 0; i < m_counters.size(); i++)
+			n += m_counters[i]->lookups;
+		return n;
+	}
+	int hits()
+	{
+		std::lock_guard<std::mutex> lock(m_countersMutex);
+		int n = 0;
+		for (size_t i = 0; i < m_counters.size(); i++)
+			n += m_counters[i]->hits;
+		return n;
+	}
+
+protected:
+	// the counters of the calling thread, created by its first lookup in this cache
+	AOCacheCounters& counters()
+	{
+		thread_local int cacheId = -1;
+		thread_local AOCacheCounters *local = nullptr;
+		if (cacheId != m_id)
+		{
+			std::lock_guard<std::mutex> lock(m_countersMutex);
+			m_counters.emplace_back(new AOCacheCounters);
+			local = m_counters.back().get();
+			cacheId = m_id;
+		}
+		return *local;
+	}
+
+	static std::atomic<int>& next_id()
+	{
+		static std::atomic<int> id(0);
+		return id;
+	}
+
+	void insert(AOCacheNode& node, const Point& nodeMin, const float size, const int depth,
+		const AORecord *record, const AABB& bounds, const float validity)
+	{
+		// the record stays in the smallest nodes at least 2 times larger than its sphere of validity
+		float childSize = size / 2.0f;
+		if (childSize < 4.0f * validity || depth == AO_CACHE_MAX_DEPTH)
+		{
+			AORecordLink *link = new AORecordLink { record, node.records.load() };
+			while (node.records.compare_exchange_weak(link->next, link) == false)
+				continue;
+			return;
+		}
+
+		for (int i = 0; i < 8; i++)
+		{
+			Point childMin(nodeMin.x + (i & 1 ? childSize : 0.0f), nodeMin.y + (i & 2 ? childSize : 0.0f), nodeMin.z + (i & 4 ? childSize : 0.0f));
+			if (bounds.maxPoint.x < childMin.x || bounds.minPoint.x > childMin.x + childSize
+				|| bounds.maxPoint.y < childMin.y || bounds.minPoint.y > childMin.y + childSize
+				|| bounds.maxPoint.z < childMin.z || bounds.minPoint.z > childMin.z + childSize)
+				continue;
+
+			// another thread may create the same child, the first one wins
+			AOCacheNode *child = node.children[i].load();
+			if (child == nullptr)
+			{
+				AOCacheNode *created = new AOCacheNode;
+				if (node.children[i].compare_exchange_strong(child, created))
+					child = created;
+				else
+					delete created;
+			}
+			insert(*child, childMin, childSize, depth + 1, record, bounds, validity);
+		}
+	}
+
+	AOCacheNode m_root;
+	Point m_min;
+	float m_size;
+	float m_maxSpacing;
+	std::atomic<AORecord *> m_records;
+	std::atomic<int> m_count;
+	int m_id;			// identifies the cache in the counters of the threads, a new cache may reuse the address of the previous one
+	std::mutex m_countersMutex;
+	vector<std::unique_ptr<AOCacheCounters>> m_counters;
+};
+
+AOCache *aoCache = nullptr;
+
+// Record of the cache : samples M x N strata of the cosine weighted hemisphere, M along theta and N ~ pi M along phi,
+// the distances to the occluders give the radius of the record and the translation gradient.
+AORecord *make_ao_record(const Hit& hit, const int samples, Sampler& sampler)
+{
+	const int M = std::max((int)(sqrt(samples / M_PI) + 0.5), 1);
+	const int N = std::max(samples / M, 1);
+
+	AORecord *record = new AORecord;
+	record->p = hit.p;
+	record->n = normalize(hit.n);
+	Vector t, b;
+	branchlessONB(record->n, t, b);
+	Point origin = hit.p + 0.001f * hit.n;
+	float tmax = aoRadius > 0.0f ? aoRadius : FLT_MAX;
+
+	// visibility and distance to the occluder of each stratum, the visible directions are at an infinite distance
+	vector<float> visible(M * N);
+	vector<float> distances(M * N);
+	vector<float> tangents(M * N);
+	float inverseDistances = 0.0f;
+	int count = 0;
+	for (int j = 0; j < M; j++)
+	{
+		for (int k = 0; k < N; k++)
+		{
+			float sin2 = (j + sampler.uniform()) / M;
+			float sinTheta = sqrt(sin2);
+			float cosTheta = sqrt(std::max(1.0f - sin2, 0.0f));
+			float phi = 2.0f * (float)M_PI * (k + sampler.uniform()) / N;
+			Vector d = sinTheta * cos(phi) * t + sinTheta * sin(phi) * b + cosTheta * record->n;
+
+			Hit occluder;
+			occluder.t = tmax;
+			bool occluded = intersect_scene(Ray(origin, d), occluder);
+			visible[j * N + k] = occluded ? 0.0f : 1.0f;
+			distances[j * N + k] = occluded ? occluder.t : FLT_MAX;
+			tangents[j * N + k] = sinTheta / std::max(cosTheta, 1e-3f);
+			if (occluded)
+				inverseDistances += 1.0f / std::max(occluder.t, 1e-6f);
+			count += occluded ? 0 : 1;
+		}
+	}
+	record->ao = count / (float)(M * N);
+	float radius = inverseDistances > 0.0f ? M * N / inverseDistances : FLT_MAX;
+	record->radius = std::min(std::max(radius, aoCache->minSpacing()), aoCache->maxSpacing());
+
+	// gradients, cf "Irradiance Gradients" eq 3 and 4, for a uniform source of radiance 1/pi
+	Vector rotation, translation;
+	for (int k = 0; k < N; k++)
+	{
+		// u and vk at the center of the strata k, v on their boundary with the strata k-1
+		float phi = 2.0f * (float)M_PI * k / N;
+		float center = phi + (float)M_PI / N;
+		Vector u = cos(center) * t + sin(center) * b;
+		Vector vk = -sin(center) * t + cos(center) * b;
+		Vector v = -sin(phi) * t + cos(phi) * b;
+		int previous = (k + N - 1) % N;
+
+		float sumRotation = 0.0f, sumU = 0.0f, sumV = 0.0f;
+		for (int j = 0; j < M; j++)
+		{
+			sumRotation -= tangents[j * N + k] * visible[j * N + k];
+
+			// change of visibility between the strata j-1 and j, along theta
+			if (j > 0)
+			{
+				float sin2 = j / (float)M;
+				float sinTheta = sqrt(sin2);
+				float r = std::min(distances[(j - 1) * N + k], distances[j * N + k]);
+				sumU += sinTheta * (1.0f - sin2) / r * (visible[j * N + k] - visible[(j - 1) * N + k]);
+			}
+			// change of visibility between the strata k-1 and k, along phi
+			float r = std::min(distances[j * N + previous], distances[j * N + k]);
+			sumV += (sqrt((j + 1) / (float)M) - sqrt(j / (float)M)) / r * (visible[j * N + k] - visible[j * N + previous]);
+		}
+		rotation = rotation + vk * sumRotation;
+		translation = translation + u * (2.0f * (float)M_PI / N * sumU) + v * sumV;
+	}
+	record->rotation = rotation / (float)(M * N);
+	record->translation = translation / (float)M_PI;
+	return record;
+}
+
+float GetAmbientOcclusionTerm(const Hit& origin, const int iterations, Sampler& sampler)
+{
+	if (aoMode == AO_CACHE)
+	{
+		float ao;
+		if (aoCache->lookup(origin.p, normalize(origin.n), ao))
+			return ao;
+		AORecord *record = make_ao_record(origin, iterations, sampler);
+		aoCache->insert(record);
+		return record->ao;
+	}
+
+	if (aoMode == AO_COSINE)
+	{
+		AOFrame frame = make_ao_frame(origin, sampler);
+		int visible = 0;
+		for (int i = 0; i < iterations; i++)
+			visible += GetCosineOcclusionSample(frame, i) > 0.0f;
+		return visible / (float)iterations;
+	}
+
+	float accumulator = 0.0f;
+	for (int i = 0; i < iterations; i++)
+		accumulator += GetAmbientOcclusionSample(origin, i, iterations, sampler);
+	return accumulator / (float)iterations;
+}
+
+// Direct lighting from the emissive sources
+// The source is chosen with the light hierarchy, then a point is chosen uniformly on its triangle. The sources emit on both sides.
+Color GetSourcesLighting(const Hit& origin, const Color& diffuse, const int iterations, Sampler& sampler)
+{
+	Color accumulator;
+	for (int i = 0; i < iterations; i++)
+	{
+		float pdf;
+		int sourceId = sample_light(origin.p, origin.n, sampler.uniform(), pdf);
+		if (sourceId == -1)
+			continue;
+
+		float u, v;
+		sampler.sample2D(i, u, v);
+		if (u + v > 1.0f)
+		{
+			u = 1.0f - u;
+			v = 1.0f - v;
+		}
+		const Source& source = sources[sourceId];
+		Point q = source.point(u, v);
+		Vector l(origin.p, q);
+		float distance2 = length2(l);
+		l = l / sqrt(distance2);
+		float cosTheta = dot(origin.n, l);
+		if (cosTheta <= 0.0f)
+			continue;
+
+		Vector n = cross(Vector(Point(source.a), Point(source.b)), Vector(Point(source.a), Point(source.c)));
+		float area = length(n) / 2.0f;
+		float cosThetaSource = std::abs(dot(n, l)) / (2.0f * area);
+
+		// Shadow ray, the segment stops just before the source
+		Ray shadow(origin.p + 0.001f * origin.n, q);
+		if (occluded(shadow, 1.0f - EPSILON))
+			continue;
+
+		accumulator = accumulator + source.emission * (cosTheta * cosThetaSource * area / (distance2 * pdf));
+	}
+	return diffuse * accumulator / (M_PI * iterations);
+}
+
+// Bounding volume hierarchy
+struct predicat
+{
+	int axe;
 	float coupe;
 
-	predicat(const int _axe, const float _coupe) : axe(_axe), coupe(_coupe) { }
-	bool operator() (const Primitive& p) const
+	predicat(const int _axe, const float _coupe) : axe(_axe), coupe(_coupe) { }
+	bool operator() (const Primitive& p) const
+	{
+		return (p.center(axe) < coupe);
+	}
+};
+
+// Split at the median of the centers on their longest axis, for the nodes deeper than BVH_MEDIAN_DEPTH
+unsigned int median_split(vector<Primitive>& primitives, const unsigned int begin, const unsigned int end, const AABB& centers)
+{
+	Vector extent(centers.minPoint, centers.maxPoint);
+	int axe = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z) ? 1 : 2;
+	unsigned int mid = (begin + end) / 2;
+	std::nth_element(primitives.data() + begin, primitives.data() + mid, primitives.data() + end,
+		[axe](const Primitive& a, const Primitive& b) { return a.center(axe) < b.center(axe); });
+	return mid;
+}
+
+unsigned int build_nodes(vector<BVHBuildNode>& nodes,
+	vector<Primitive>& primitives,
+	const unsigned int begin,
+	const unsigned int end,
+	const unsigned int maxLeafSize = 1,
+	const int depth = 1)
+{
+	if (end - begin <= std::max(maxLeafSize, 1u))
+	{
+		// construire une feuille qui reference les primitives d'indices [begin .. end[, et la boite englobante de leurs triangles...
+		// renvoyer l'indice de la feuille
+		AABB bounds = AABB::empty();
+		for (unsigned int i = begin; i < end; i++)
+			bounds.grow(primitives[i].bounds);
+		nodes.push_back(BVHBuildNode::leaf(bounds, begin, end - begin));
+		return nodes.size() - 1;
+	}
+
+	// Construire la boite englobante des centres des primitives d'indices [begin .. end[
+	AABB b = AABB::empty();
+	for (unsigned int i = begin; i < end; i++)
+		b.grow(primitives[i].center);
+
+	// Trouver l'axe le plus etire de la boite englobante
+	// Couper en 2 au milieu de boite englobante sur l'axe le plus etire
+	Vector temp(b.maxPoint - b.minPoint);
+	float maxValue = max(max(temp.x, temp.y), temp.z);
+	int axe = (maxValue == temp.x) ? 0 : (maxValue == temp.y) ? 1 : 2;
+	float coupe = (b.minPoint(axe) + b.maxPoint(axe)) / 2.0f;
+
+	// partitionner les primitives par rapport a la "coupe", ou par rapport a la mediane dans le bas d'un arbre trop profond
+	unsigned int mid;
+	if (depth >= BVH_MEDIAN_DEPTH)
+		mid = median_split(primitives, begin, end, b);
+	else
+	{
+		Primitive* pmid = partition(primitives.data() + begin, primitives.data() + end, predicat(axe, coupe));
+		mid = distance(primitives.data(), pmid);
+	}
+
+	// verifier que la partition n'est pas degeneree (toutes les primitives du meme cote de la separation)
+	if (mid == begin || mid == end)
+		mid = (begin + end) / 2;
+	assert(mid != begin);
+	assert(mid != end);
+	// remarque : il est possible que 2 (ou plus) primitives aient le meme centre,
+	// dans ce cas, la boite englobante des centres est reduite à un point, et la partition est forcement degeneree
+	// une solution est de construire une feuille,
+	// ou, autre solution, forcer une repartition arbitraire des primitives entre 2 les fils, avec mid= (begin + end) / 2
+
+	// construire le fils gauche 
+	unsigned int left = build_nodes(nodes, primitives, begin, mid, maxLeafSize, depth + 1);
+
+	// construire le fils droit 
+	unsigned int right = build_nodes(nodes, primitives, mid, end, maxLeafSize, depth + 1);
+
+	// construire un noeud interne
+	// quelle est sa boite englobante ?
+	AABB nodeBox;
+	nodeBox.minPoint = min(nodes[left].aabb.minPoint, nodes[right].aabb.minPoint);
+	nodeBox.maxPoint = max(nodes[left].aabb.maxPoint, nodes[right].aabb.maxPoint);
+	nodes.push_back(BVHBuildNode(nodeBox, left, right));
+
+	// renvoyer l'indice du noeud
+	return nodes.size() - 1;
+}
+
+// Surface area heuristic BVH, split candidates are evaluated on a fixed number of bins per axis
+const int SAH_BIN_COUNT = 16;
+const float SAH_TRAVERSAL_COST = 1.0f;
+const float SAH_INTERSECTION_COST = 1.0f;
+
+struct SAHBin
+{
+	AABB bounds = AABB::empty();
+	int count = 0;
+};
+
+struct binPredicat
+{
+	int axe;
+	float origin;
+	float scale;
+	int split;
+
+	binPredicat(const int _axe, const float _origin, const float _scale, const int _split) : axe(_axe), origin(_origin), scale(_scale), split(_split) { }
+	int bin(const Point& center) const
+	{
+		int b = (int)((center(axe) - origin) * scale);
+		return std::min(std::max(b, 0), SAH_BIN_COUNT - 1);
+	}
+	bool operator() (const Primitive& p) const
+	{
+		return (bin(p.center) < split);
+	}
+};
+
+// Bin the primitives [begin .. end[ on the 3 axes of the centers box
+void bin_primitives(const Primitive* primitives,
+	const unsigned int begin,
+	const unsigned int end,
+	const AABB& centers,
+	SAHBin bins[3][SAH_BIN_COUNT])
+{
+	Vector extent(centers.minPoint, centers.maxPoint);
+	for (int axe = 0; axe < 3; axe++)
+	{
+		if (extent(axe) <= 0.0f)
+			continue;
+
+		binPredicat binning(axe, centers.minPoint(axe), SAH_BIN_COUNT / extent(axe), 0);
+		for (unsigned int i = begin; i < end; i++)
+		{
+			SAHBin& bin = bins[axe][binning.bin(primitives[i].center)];
+			bin.bounds.grow(primitives[i].bounds);
+			bin.count++;
+		}
+	}
+}
+
+// Evaluate the SAH cost of every bin boundary on the 3 axes, returns false if no split is possible
+bool find_sah_split(const SAHBin bins[3][SAH_BIN_COUNT], const AABB& centers, binPredicat& bestSplit, float& bestCost)
+{
+	bestCost = FLT_MAX;
+	int bestAxe = -1;
+	Vector extent(centers.minPoint, centers.maxPoint);
+	for (int axe = 0; axe < 3; axe++)
+	{
+		if (extent(axe) <= 0.0f)
+			continue;
+
+		// Sweep from the right to get the area and count right of each boundary, then from the left
+		float rightArea[SAH_BIN_COUNT];
+		int rightCount[SAH_BIN_COUNT];
+		AABB accumulated = AABB::empty();
+		int accumulatedCount = 0;
+		for (int i = SAH_BIN_COUNT - 1; i > 0; i--)
+		{
+			accumulated.grow(bins[axe][i].bounds);
+			accumulatedCount += bins[axe][i].count;
+			rightArea[i] = accumulated.area();
+			rightCount[i] = accumulatedCount;
+		}
+
+		accumulated = AABB::empty();
+		accumulatedCount = 0;
+		for (int i = 1; i < SAH_BIN_COUNT; i++)
+		{
+			accumulated.grow(bins[axe][i - 1].bounds);
+			accumulatedCount += bins[axe][i - 1].count;
+			if (accumulatedCount == 0 || rightCount[i] == 0)
+				continue;
+
+			float cost = accumulated.area() * accumulatedCount + rightArea[i] * rightCount[i];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxe = axe;
+				bestSplit = binPredicat(axe, centers.minPoint(axe), SAH_BIN_COUNT / extent(axe), i);
+			}
+		}
+	}
+	return bestAxe != -1;
+}
+
+// Compare the cost of a split with the cost of a leaf, the split cost is not yet divided by the node area
+bool make_sah_leaf(const AABB& bounds, const unsigned int count, const unsigned int maxLeafSize, const bool canSplit, const float splitCost)
+{
+	if (count == 1)
+		return true;
+	float leafCost = SAH_INTERSECTION_COST * count;
+	float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * splitCost / bounds.area();
+	return count <= maxLeafSize && (!canSplit || leafCost <= cost);
+}
+
+unsigned int build_nodes_sah(vector<BVHBuildNode>& nodes,
+	vector<Primitive>& primitives,
+	const unsigned int begin,
+	const unsigned int end,
+	const unsigned int maxLeafSize,
+	const int depth = 1)
+{
+	// Bounds of the primitives and of their centers
+	AABB bounds = AABB::empty();
+	AABB centers = AABB::empty();
+	for (unsigned int i = begin; i < end; i++)
+	{
+		bounds.grow(primitives[i].bounds);
+		centers.grow(primitives[i].center);
+	}
+
+	unsigned int count = end - begin;
+	if (depth >= BVH_MEDIAN_DEPTH)
+	{
+		// too deep for the traversal stacks, no SAH split
+		if (count <= maxLeafSize)
+		{
+			nodes.push_back(BVHBuildNode::leaf(bounds, begin, count));
+			return nodes.size() - 1;
+		}
+		unsigned int mid = median_split(primitives, begin, end, centers);
+		unsigned int left = build_nodes_sah(nodes, primitives, begin, mid, maxLeafSize, depth + 1);
+		unsigned int right = build_nodes_sah(nodes, primitives, mid, end, maxLeafSize, depth + 1);
+		nodes.push_back(BVHBuildNode(bounds, left, right));
+		return nodes.size() - 1;
+	}
+
+	SAHBin bins[3][SAH_BIN_COUNT];
+	if (count > 1)
+		bin_primitives(primitives.data(), begin, end, centers, bins);
+
+	binPredicat split(0, 0, 0, 0);
+	float splitCost = FLT_MAX;
+	bool canSplit = count > 1 && find_sah_split(bins, centers, split, splitCost);
+	if (make_sah_leaf(bounds, count, maxLeafSize, canSplit, splitCost))
+	{
+		nodes.push_back(BVHBuildNode::leaf(bounds, begin, count));
+		return nodes.size() - 1;
+	}
+
+	unsigned int mid;
+	if (canSplit)
+	{
+		Primitive* pmid = partition(primitives.data() + begin, primitives.data() + end, split);
+		mid = distance(primitives.data(), pmid);
+	}
+	else
+		// All the centers are the same, no useful split : force an arbitrary one
+		mid = (begin + end) / 2;
+	assert(mid != begin);
+	assert(mid != end);
+
+	unsigned int left = build_nodes_sah(nodes, primitives, begin, mid, maxLeafSize, depth + 1);
+	unsigned int right = build_nodes_sah(nodes, primitives, mid, end, maxLeafSize, depth + 1);
+	nodes.push_back(BVHBuildNode(bounds, left, right));
+	return nodes.size() - 1;
+}
+
+// Parallel SAH BVH : the top of the tree is built with data parallel binning and partition,
+// subtrees are built by concurrent OpenMP tasks and the nodes are stored in a preallocated array
+const unsigned int PARALLEL_BUILD_GRAIN = 16384;		// primitives per binning / partition task
+const unsigned int PARALLEL_BUILD_SUBTREE = 65536;	// below, a subtree is built by a single task
+
+struct ParallelBuild
+{
+	vector<BVHBuildNode>& nodes;
+	vector<Primitive>& primitives;
+	vector<Primitive> scratch;
+	std::atomic<unsigned int> nodeCount;
+	unsigned int maxLeafSize;
+
+	ParallelBuild(vector<BVHBuildNode>& n, vector<Primitive>& p, const unsigned int leafSize)
+		: nodes(n), primitives(p), scratch(p.size()), nodeCount(0), maxLeafSize(leafSize) { }
+
+	unsigned int allocate(const unsigned int count)
+	{
+		return nodeCount.fetch_add(count);
+	}
+};
+
+// Build a small subtree sequentially, then copy it at its place in the shared node array
+unsigned int build_subtree_parallel(ParallelBuild& build, const unsigned int begin, const unsigned int end, const int depth)
+{
+	vector<BVHBuildNode> local;
+	local.reserve(2 * (end - begin));
+	unsigned int root = build_nodes_sah(local, build.primitives, begin, end, build.maxLeafSize, depth);
+
+	unsigned int offset = build.allocate(local.size());
+	for (size_t i = 0; i < local.size(); i++)
+	{
+		BVHBuildNode node = local[i];
+		if (!node.isLeaf())
+		{
+			node.leftId += offset;
+			node.rightId += offset;
+		}
+		build.nodes[offset + i] = node;
+	}
+	return offset + root;
+}
+
+unsigned int build_nodes_parallel(ParallelBuild& build, const unsigned int begin, const unsigned int end, const int depth = 1)
+{
+	unsigned int count = end - begin;
+	if (count <= PARALLEL_BUILD_SUBTREE || depth >= BVH_MEDIAN_DEPTH)
+		return build_subtree_parallel(build, begin, end, depth);
+
+	Primitive* primitives = build.primitives.data();
+	unsigned int chunks = (count + PARALLEL_BUILD_GRAIN - 1) / PARALLEL_BUILD_GRAIN;
+	vector<AABB> chunkBounds(chunks, AABB::empty());
+	vector<AABB> chunkCenters(chunks, AABB::empty());
+
+	// Bounds of the primitives and of their centers
+	for (unsigned int c = 0; c < chunks; c++)
+	{
+		#pragma omp task firstprivate(c) shared(chunkBounds, chunkCenters)
+		{
+			unsigned int cend = std::min(begin + (c + 1) * PARALLEL_BUILD_GRAIN, end);
+			for (unsigned int i = begin + c * PARALLEL_BUILD_GRAIN; i < cend; i++)
+			{
+				chunkBounds[c].grow(primitives[i].bounds);
+				chunkCenters[c].grow(primitives[i].center);
+			}
+		}
+	}
+	#pragma omp taskwait
+
+	AABB bounds = AABB::empty();
+	AABB centers = AABB::empty();
+	for (unsigned int c = 0; c < chunks; c++)
+	{
+		bounds.grow(chunkBounds[c]);
+		centers.grow(chunkCenters[c]);
+	}
+
+	// Bin each chunk, then merge the bins
+	vector<SAHBin> chunkBins(chunks * 3 * SAH_BIN_COUNT);
+	for (unsigned int c = 0; c < chunks; c++)
+	{
+		#pragma omp task firstprivate(c) shared(chunkBins, centers)
+		{
+			unsigned int cend = std::min(begin + (c + 1) * PARALLEL_BUILD_GRAIN, end);
+			SAHBin (*bins)[SAH_BIN_COUNT] = (SAHBin (*)[SAH_BIN_COUNT]) &chunkBins[c * 3 * SAH_BIN_COUNT];
+			bin_primitives(primitives, begin + c * PARALLEL_BUILD_GRAIN, cend, centers, bins);
+		}
+	}
+	#pragma omp taskwait
+
+	SAHBin bins[3][SAH_BIN_COUNT];
+	for (unsigned int c = 0; c < chunks; c++)
+		for (int axe = 0; axe < 3; axe++)
+			for (int i = 0; i < SAH_BIN_COUNT; i++)
+			{
+				const SAHBin& bin = chunkBins[(c * 3 + axe) * SAH_BIN_COUNT + i];
+				bins[axe][i].bounds.grow(bin.bounds);
+				bins[axe][i].count += bin.count;
+			}
+
+	binPredicat split(0, 0, 0, 0);
+	float splitCost;
+	if (!find_sah_split(bins, centers, split, splitCost))
+		// All the centers are the same, the sequential builder handles the degenerate case
+		return build_subtree_parallel(build, begin, end, depth);
+
+	// Partition : count the primitives on the left of the split in each chunk,
+	// then scatter the chunks to their final place in the scratch array and copy back
+	vector<unsigned int> leftCounts(chunks + 1, 0);
+	for (unsigned int c = 0; c < chunks; c++)
+	{
+		#pragma omp task firstprivate(c) shared(leftCounts, split)
+		{
+			unsigned int cend = std::min(begin + (c + 1) * PARALLEL_BUILD_GRAIN, end);
+			for (unsigned int i = begin + c * PARALLEL_BUILD_GRAIN; i < cend; i++)
+				leftCounts[c + 1] += split(primitives[i]) ? 1 : 0;
+		}
+	}
+	#pragma omp taskwait
+
+	for (unsigned int c = 0; c < chunks; c++)
+		leftCounts[c + 1] += leftCounts[c];
+	unsigned int mid = begin + leftCounts[chunks];
+
+	Primitive* scratch = build.scratch.data();
+	for (unsigned int c = 0; c < chunks; c++)
+	{
+		#pragma omp task firstprivate(c) shared(leftCounts, split)
+		{
+			unsigned int cbegin = begin + c * PARALLEL_BUILD_GRAIN;
+			unsigned int cend = std::min(cbegin + PARALLEL_BUILD_GRAIN, end);
+			unsigned int left = begin + leftCounts[c];
+			unsigned int right = mid + (cbegin - begin) - leftCounts[c];
+			for (unsigned int i = cbegin; i < cend; i++)
+			{
+				if (split(primitives[i]))
+					scratch[left++] = primitives[i];
+				else
+					scratch[right++] = primitives[i];
+			}
+		}
+	}
+	#pragma omp taskwait
+
+	for (unsigned int c = 0; c < chunks; c++)
+	{
+		#pragma omp task firstprivate(c)
+		{
+			unsigned int cbegin = begin + c * PARALLEL_BUILD_GRAIN;
+			unsigned int cend = std::min(cbegin + PARALLEL_BUILD_GRAIN, end);
+			std::copy(scratch + cbegin, scratch + cend, primitives + cbegin);
+		}
+	}
+	#pragma omp taskwait
+	assert(mid != begin);
+	assert(mid != end);
+
+	// Build the 2 subtrees concurrently
+	unsigned int nodeId = build.allocate(1);
+	unsigned int left, right;
+	ParallelBuild* shared = &build;
+	#pragma omp task shared(left)
+	left = build_nodes_parallel(*shared, begin, mid, depth + 1);
+	#pragma omp task shared(right)
+	right = build_nodes_parallel(*shared, mid, end, depth + 1);
+	#pragma omp taskwait
+
+	build.nodes[nodeId] = BVHBuildNode(bounds, left, right);
+	return nodeId;
+}
+
+// Copy the tree in depth first order : the left child of a node is stored right after it,
+// leaves reference the primitives range, which is also the range of their triangles once reordered
+int flatten_nodes(const vector<BVHBuildNode>& nodes, const int nodeId, vector<BVHNode>& flat, const int depth, int& maxDepth)
+{
+	maxDepth = std::max(maxDepth, depth);
+	const BVHBuildNode& node = nodes[nodeId];
+	int id = (int)flat.size();
+	if (node.isLeaf())
+	{
+		flat.push_back(BVHNode(node.aabb, node.firstPrimitive, node.primitiveCount));
+		return id;
+	}
+
+	flat.push_back(BVHNode(node.aabb, -1, 0));
+	int left = flatten_nodes(nodes, node.leftId, flat, depth + 1, maxDepth);
+	int right = flatten_nodes(nodes, node.rightId, flat, depth + 1, maxDepth);
+	assert(left == id + 1);
+	flat[id].offset = right;
+	return id;
+}
+
+// Spatial split BVH, cf "Spatial Splits in Bounding Volume Hierarchies", Stich, Friedrich, Dietrich, 2009
+// Besides the object splits of the SAH builder, a node can be cut by a plane : the triangles that cross the plane are
+// referenced by both children, with their box clipped on each side. The triangles are duplicated in the leaves.
+const float SBVH_OVERLAP_THRESHOLD = 1e-5f;		// spatial splits are tried when the children of the object split overlap more, relative to the root area
+const float SBVH_DUPLICATION_BUDGET = 0.3f;		// at most 30% more references than triangles
+const int SBVH_MAX_DEPTH = BVH_STACK_SIZE - 8;
+
+struct SBVHBuild
+{
+	vector<BVHBuildNode>& nodes;
+	const vector<Triangle>& triangles;
+	vector<Primitive> references;		//!< references des feuilles, dans l'ordre des feuilles.
+	unsigned int maxReferences;
+	unsigned int referenceCount;		//!< nombre de references en cours de construction.
+	unsigned int maxLeafSize;
+	float rootArea;
+
+	SBVHBuild(vector<BVHBuildNode>& n, const vector<Triangle>& t, const unsigned int count, const unsigned int leafSize)
+		: nodes(n), triangles(t), maxReferences((unsigned int)(count * (1 + SBVH_DUPLICATION_BUDGET))), referenceCount(count), maxLeafSize(leafSize), rootArea(0) { }
+};
+
+AABB overlap(const AABB& a, const AABB& b)
+{
+	return AABB(max(a.minPoint, b.minPoint), min(a.maxPoint, b.maxPoint));
+}
+
+bool empty_box(const AABB& b)
+{
+	return b.minPoint.x > b.maxPoint.x || b.minPoint.y > b.maxPoint.y || b.minPoint.z > b.maxPoint.z;
+}
+
+// Split the part of the triangle inside bounds by the plane axe = position, the parts are empty boxes if there is nothing on a side
+void split_triangle(const Triangle& t, const AABB& bounds, const int axe, const float position, AABB& left, AABB& right)
+{
+	left = AABB::empty();
+	right = AABB::empty();
+	Point p[3] = { Point(t.a), Point(t.b), Point(t.c) };
+	for (int i = 0; i < 3; i++)
+	{
+		const Point& v0 = p[i];
+		const Point& v1 = p[(i + 1) % 3];
+		if (v0(axe) <= position)
+			left.grow(v0);
+		if (v0(axe) >= position)
+			right.grow(v0);
+
+		// the edge crosses the plane
+		if ((v0(axe) < position && v1(axe) > position) || (v0(axe) > position && v1(axe) < position))
+		{
+			float s = (position - v0(axe)) / (v1(axe) - v0(axe));
+			Point q = v0 + s * Vector(v0, v1);
+			left.grow(q);
+			right.grow(q);
+		}
+	}
+
+	left = overlap(left, bounds);
+	right = overlap(right, bounds);
+	left.maxPoint = Point(axe == 0 ? std::min(left.maxPoint.x, position) : left.maxPoint.x, axe == 1 ? std::min(left.maxPoint.y, position) : left.maxPoint.y, axe == 2 ? std::min(left.maxPoint.z, position) : left.maxPoint.z);
+	right.minPoint = Point(axe == 0 ? std::max(right.minPoint.x, position) : right.minPoint.x, axe == 1 ? std::max(right.minPoint.y, position) : right.minPoint.y, axe == 2 ? std::max(right.minPoint.z, position) : right.minPoint.z);
+}
+
+Primitive make_reference(const AABB& bounds, const int triangleId)
+{
+	Primitive p;
+	p.bounds = bounds;
+	p.center = bounds.center();
+	p.triangleId = triangleId;
+	return p;
+}
+
+struct SpatialBin
+{
+	AABB bounds = AABB::empty();
+	int entries = 0;	//!< nombre de references qui commencent dans la case.
+	int exits = 0;		//!< nombre de references qui finissent dans la case.
+};
+
+struct SpatialSplit
+{
+	int axe = -1;
+	float position = 0;
+	float cost = FLT_MAX;
+};
+
+// Chopped binning of the references on the bounds of the node : a reference is clipped in every bin it crosses
+SpatialSplit find_spatial_split(const SBVHBuild& build, const vector<Primitive>& references, const AABB& bounds)
+{
+	SpatialSplit best;
+	Vector extent(bounds.minPoint, bounds.maxPoint);
+	for (int axe = 0; axe < 3; axe++)
+	{
+		if (extent(axe) <= 0.0f)
+			continue;
+
+		SpatialBin bins[SAH_BIN_COUNT];
+		float origin = bounds.minPoint(axe);
+		float width = extent(axe) / SAH_BIN_COUNT;
+		for (size_t i = 0; i < references.size(); i++)
+		{
+			const Primitive& reference = references[i];
+			int first = std::min(std::max((int)((reference.bounds.minPoint(axe) - origin) / width), 0), SAH_BIN_COUNT - 1);
+			int last = std::min(std::max((int)((reference.bounds.maxPoint(axe) - origin) / width), first), SAH_BIN_COUNT - 1);
+
+			AABB remaining = reference.bounds;
+			for (int b = first; b < last; b++)
+			{
+				AABB left, right;
+				split_triangle(build.triangles[reference.triangleId], remaining, axe, origin + (b + 1) * width, left, right);
+				bins[b].bounds.grow(left);
+				remaining = right;
+			}
+			bins[last].bounds.grow(remaining);
+			bins[first].entries++;
+			bins[last].exits++;
+		}
+
+		// same sweep as the object split, the references that cross the plane are counted on both sides
+		float rightArea[SAH_BIN_COUNT];
+		int rightCount[SAH_BIN_COUNT];
+		AABB accumulated = AABB::empty();
+		int accumulatedCount = 0;
+		for (int i = SAH_BIN_COUNT - 1; i > 0; i--)
+		{
+			accumulated.grow(bins[i].bounds);
+			accumulatedCount += bins[i].exits;
+			rightArea[i] = accumulated.area();
+			rightCount[i] = accumulatedCount;
+		}
+
+		accumulated = AABB::empty();
+		accumulatedCount = 0;
+		for (int i = 1; i < SAH_BIN_COUNT; i++)
+		{
+			accumulated.grow(bins[i - 1].bounds);
+			accumulatedCount += bins[i - 1].entries;
+			if (accumulatedCount == 0 || rightCount[i] == 0)
+				continue;
+			if (accumulatedCount == (int)references.size() && rightCount[i] == (int)references.size())
+				continue;
+
+			float cost = accumulated.area() * accumulatedCount + rightArea[i] * rightCount[i];
+			if (cost < best.cost)
+			{
+				best.axe = axe;
+				best.position = origin + i * width;
+				best.cost = cost;
+			}
+		}
+	}
+	return best;
+}
+
+unsigned int build_nodes_sbvh(SBVHBuild& build, vector<Primitive>& references, const int depth)
+{
+	AABB bounds = AABB::empty();
+	AABB centers = AABB::empty();
+	for (size_t i = 0; i < references.size(); i++)
+	{
+		bounds.grow(references[i].bounds);
+		centers.grow(references[i].center);
+	}
+	if (depth == 0)
+		build.rootArea = bounds.area();
+
+	// Object split, as the SAH builder
+	unsigned int count = (unsigned int)references.size();
+	SAHBin bins[3][SAH_BIN_COUNT];
+	if (count > 1)
+		bin_primitives(references.data(), 0, count, centers, bins);
+
+	binPredicat split(0, 0, 0, 0);
+	float splitCost = FLT_MAX;
+	bool canSplit = count > 1 && find_sah_split(bins, centers, split, splitCost);
+
+	// Spatial split, only if the children of the object split overlap and if the duplication budget is not spent
+	SpatialSplit spatial;
+	if (canSplit && depth < SBVH_MAX_DEPTH && build.referenceCount < build.maxReferences)
+	{
+		AABB left = AABB::empty();
+		AABB right = AABB::empty();
+		for (int i = 0; i < SAH_BIN_COUNT; i++)
+			(i < split.split ? left : right).grow(bins[split.axe][i].bounds);
+		if (overlap(left, right).area() > SBVH_OVERLAP_THRESHOLD * build.rootArea)
+			spatial = find_spatial_split(build, references, bounds);
+	}
+
+	float cost = std::min(splitCost, spatial.cost);
+	if (make_sah_leaf(bounds, count, build.maxLeafSize, canSplit, cost))
+	{
+		build.nodes.push_back(BVHBuildNode::leaf(bounds, (int)build.references.size(), count));
+		build.references.insert(build.references.end(), references.begin(), references.end());
+		vector<Primitive>().swap(references);
+		return build.nodes.size() - 1;
+	}
+
+	vector<Primitive> leftReferences;
+	vector<Primitive> rightReferences;
+	if (spatial.cost < splitCost)
+	{
+		for (size_t i = 0; i < references.size(); i++)
+		{
+			const Primitive& reference = references[i];
+			if (reference.bounds.maxPoint(spatial.axe) <= spatial.position)
+				leftReferences.push_back(reference);
+			else if (reference.bounds.minPoint(spatial.axe) >= spatial.position)
+				rightReferences.push_back(reference);
+			else
+			{
+				// the triangle crosses the plane, a reference on each side, unless the clipping leaves nothing on a side
+				AABB left, right;
+				split_triangle(build.triangles[reference.triangleId], reference.bounds, spatial.axe, spatial.position, left, right);
+				if (empty_box(left))
+					rightReferences.push_back(reference);
+				else if (empty_box(right))
+					leftReferences.push_back(reference);
+				else
+				{
+					leftReferences.push_back(make_reference(left, reference.triangleId));
+					rightReferences.push_back(make_reference(right, reference.triangleId));
+				}
+			}
+		}
+		build.referenceCount += (unsigned int)(leftReferences.size() + rightReferences.size() - references.size());
+	}
+	else
+	{
+		Primitive* pmid = references.data() + count / 2;
+		if (canSplit)
+			pmid = partition(references.data(), references.data() + count, split);
+		leftReferences.assign(references.data(), pmid);
+		rightReferences.assign(pmid, references.data() + count);
+	}
+	vector<Primitive>().swap(references);
+	assert(leftReferences.empty() == false);
+	assert(rightReferences.empty() == false);
+
+	unsigned int left = build_nodes_sbvh(build, leftReferences, depth + 1);
+	unsigned int right = build_nodes_sbvh(build, rightReferences, depth + 1);
+	build.nodes.push_back(BVHBuildNode(bounds, left, right));
+	return build.nodes.size() - 1;
+}
+
+// Only the triangles can be split, the other elements are built with the SAH builder
+inline const vector<Triangle> *sbvh_triangles(const vector<Triangle>& elements) { return &elements; }
+template <typename T>
+const vector<Triangle> *sbvh_triangles(const vector<T>& elements) { return NULL; }
+
+// Build the scene's BVH with the selected builder, returns the root node
+// The triangles are reordered to follow the leaves, so a leaf tests a contiguous range of triangles
+enum BVHBuilder { BVH_MIDDLE, BVH_SAH, BVH_SAH_PARALLEL, BVH_SBVH };
+const char* bvhBuilderNames[] = { "middle", "SAH", "parallel SAH", "spatial split" };
+
+// builds the BVH of the primitives and stores the elements they reference, triangles or instances, in the order of the leaves
+template <typename T>
+unsigned int build_bvh(vector<BVHNode>& nodes, vector<T>& elements, vector<Primitive>& primitives, const BVHBuilder builder, const unsigned int maxLeafSize)
+{
+	vector<BVHBuildNode> buildNodes;
+	buildNodes.reserve(2 * primitives.size());
+
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	unsigned int root;
+	if (builder == BVH_SBVH && sbvh_triangles(elements) != NULL && primitives.empty() == false)
+	{
+		SBVHBuild build(buildNodes, *sbvh_triangles(elements), (unsigned int)primitives.size(), std::max(maxLeafSize, 1u));
+		root = build_nodes_sbvh(build, primitives, 0);
+		primitives.swap(build.references);
+		printf("%d references, %d duplicated triangles.\n", (int)primitives.size(), (int)(primitives.size() - elements.size()));
+	}
+	else if (builder == BVH_SAH_PARALLEL)
+	{
+		buildNodes.resize(2 * primitives.size(), BVHBuildNode(AABB()));
+		ParallelBuild build(buildNodes, primitives, std::max(maxLeafSize, 1u));
+		#pragma omp parallel
+		#pragma omp single
+		root = build_nodes_parallel(build, 0, primitives.size());
+		buildNodes.resize(build.nodeCount, BVHBuildNode(AABB()));
+	}
+	else if (builder == BVH_SAH || builder == BVH_SBVH)
+		root = build_nodes_sah(buildNodes, primitives, 0, primitives.size(), std::max(maxLeafSize, 1u));
+	else
+		root = build_nodes(buildNodes, primitives, 0, primitives.size(), maxLeafSize);
+
+	// Depth first layout for the traversal, the root is the first node
+	nodes.clear();
+	nodes.reserve(buildNodes.size());
+	int depth = 0;
+	flatten_nodes(buildNodes, root, nodes, 1, depth);
+	assert(depth <= BVH_STACK_SIZE);
+
+	// Store the elements in the order of the primitives
+	vector<T> sorted(primitives.size());
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < (int)primitives.size(); i++)
+	{
+		sorted[i] = elements[primitives[i].triangleId];
+		primitives[i].triangleId = i;
+	}
+	elements.swap(sorted);
+
+	int elapsed = (int)chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count();
+	printf("%d BVH nodes (%dKB), depth %d, %s builder, %dms.\n", (int)nodes.size(), (int)(nodes.size() * sizeof(BVHNode) / 1024), depth, bvhBuilderNames[builder], elapsed);
+	return 0;
+}
+
+// Scene of instances, read from a text file with one mesh or one instance per line :
+//	mesh <file.obj>
+//	instance <mesh index> <tx ty tz> <sx sy sz> <rotation around y, in degrees>
+// the BVH of each mesh is built when the mesh is read.
+bool read_instances(const char *filename, const BVHBuilder builder, const unsigned int maxLeafSize)
+{
+	FILE *in = fopen(filename, "rt");
+	if (in == NULL)
+	{
+		printf("[error] loading instances '%s'...\n", filename);
+		return false;
+	}
+
+	bool valid = true;
+	char line[1024];
+	while (valid && fgets(line, sizeof(line), in) != NULL)
+	{
+		char path[1024];
+		int meshId;
+		float tx, ty, tz, sx, sy, sz, ry;
+		if (sscanf(line, " mesh %1023s", path) == 1)
+		{
+			MeshBVH mesh;
+			mesh.filename = path;
+			mesh.mesh = read_mesh(path);
+			if (mesh.mesh == Mesh::error())
+				valid = false;
+			else
+			{
+				vector<Primitive> meshPrimitives;
+				build_triangles(mesh.mesh, mesh.triangles, meshPrimitives);
+				build_bvh(mesh.nodes, mesh.triangles, meshPrimitives, builder, maxLeafSize);
+				build_triangle_soa(mesh.soa, mesh.triangles);
+				meshBVHs.push_back(std::move(mesh));
+			}
+		}
+		else if (sscanf(line, " instance %d %f %f %f %f %f %f %f", &meshId, &tx, &ty, &tz, &sx, &sy, &sz, &ry) == 8)
+		{
+			if (meshId < 0 || meshId >= (int)meshBVHs.size())
+			{
+				printf("[error] instance of an unknown mesh %d\n", meshId);
+				valid = false;
+			}
+			else
+				instances.push_back(Instance(meshId, Translation(tx, ty, tz) * RotationY(ry) * Scale(sx, sy, sz)));
+		}
+	}
+	fclose(in);
+
+	printf("%d meshes, %d instances.\n", (int)meshBVHs.size(), (int)instances.size());
+	return valid && !instances.empty();
+}
+
+// Top level BVH over the bounds of the instances in the scene, and the sources of every instance
+unsigned int build_instances(const BVHBuilder builder)
+{
+	vector<Primitive> instancePrimitives(instances.size());
+	for (size_t i = 0; i < instances.size(); i++)
+	{
+		const AABB& box = meshBVHs[instances[i].meshId].nodes[0].aabb;
+		AABB bounds = AABB::empty();
+		for (int corner = 0; corner < 8; corner++)
+		{
+			Point p((corner & 1) ? box.maxPoint.x : box.minPoint.x,
+				(corner & 2) ? box.maxPoint.y : box.minPoint.y,
+				(corner & 4) ? box.maxPoint.z : box.minPoint.z);
+			bounds.grow(instances[i].model(p));
+		}
+
+		instancePrimitives[i].bounds = bounds;
+		instancePrimitives[i].center = bounds.center();
+		instancePrimitives[i].triangleId = (int)i;
+	}
+	build_bvh(instanceBVH, instances, instancePrimitives, builder, 1);
+
+	for (size_t i = 0; i < instances.size(); i++)
+		build_sources(meshBVHs[instances[i].meshId].mesh, instances[i].model);
+	return 0;
+}
+
+// MAIN
+// BVH refit for animated scenes
+// The tree is kept, the boxes of the nodes are recomputed bottom up from the triangles that moved. With the depth first
+// layout, the subtree of a node is the range [nodeId .. end[ of the nodes, and its right child starts at node.offset :
+// the large subtrees are refit by parallel tasks. The boxes of a refit BVH overlap more and more as the triangles move,
+// its SAH cost is compared to the cost after the last full build to decide when to rebuild it.
+const unsigned int PARALLEL_REFIT_GRAIN = 4096;		// nodes refit by a single task
+const float BVH_REBUILD_THRESHOLD = 1.5f;			// rebuild when the SAH cost grows by 50% after the last build
+
+struct BVHRefit
+{
+	vector<BVHNode>& nodes;
+	const vector<Triangle>& triangles;
+	const vector<unsigned char>& changed;	//!< vrai pour les triangles qui ont bouge.
+
+	BVHRefit(vector<BVHNode>& n, const vector<Triangle>& t, const vector<unsigned char>& c) : nodes(n), triangles(t), changed(c) { }
+};
+
+//! renvoie vrai si la boite du noeud a ete recalculee.
+bool refit_nodes(BVHRefit* refit, const int nodeId, const int end)
+{
+	BVHNode& node = refit->nodes[nodeId];
+	if (node.isLeaf())
+	{
+		bool moved = false;
+		for (int i = node.offset; i < node.offset + node.triangleCount; i++)
+			moved = moved || refit->changed[i];
+		if (moved == false)
+			return false;
+
+		AABB bounds = AABB::empty();
+		for (int i = node.offset; i < node.offset + node.triangleCount; i++)
+		{
+			const Triangle& t = refit->triangles[i];
+			bounds.grow(Point(t.a));
+			bounds.grow(Point(t.b));
+			bounds.grow(Point(t.c));
+		}
+		node.aabb = bounds;
+		return true;
+	}
+
+	int leftId = nodeId + 1;
+	int rightId = node.offset;
+	bool leftMoved, rightMoved;
+	if (end - nodeId > (int)PARALLEL_REFIT_GRAIN)
+	{
+		#pragma omp task shared(leftMoved)
+		leftMoved = refit_nodes(refit, leftId, rightId);
+		rightMoved = refit_nodes(refit, rightId, end);
+		#pragma omp taskwait
+	}
+	else
+	{
+		leftMoved = refit_nodes(refit, leftId, rightId);
+		rightMoved = refit_nodes(refit, rightId, end);
+	}
+	if (leftMoved == false && rightMoved == false)
+		return false;
+
+	AABB bounds = AABB::empty();
+	bounds.grow(refit->nodes[leftId].aabb);
+	bounds.grow(refit->nodes[rightId].aabb);
+	node.aabb = bounds;
+	return true;
+}
+
+void refit_bvh(vector<BVHNode>& nodes, const vector<Triangle>& triangles, const vector<unsigned char>& changed)
+{
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	BVHRefit refit(nodes, triangles, changed);
+	#pragma omp parallel
+	#pragma omp single
+	refit_nodes(&refit, 0, (int)nodes.size());
+
+	int elapsed = (int)chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+	printf("BVH refit, %dus.\n", elapsed);
+}
+
+// SAH cost of the BVH, relative to the area of its root
+float bvh_sah_cost(const vector<BVHNode>& nodes)
+{
+	float rootArea = nodes[0].aabb.area();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+
+	double cost = 0.0;
+#pragma omp parallel for schedule(static) reduction(+: cost)
+	for (int i = 0; i < (int)nodes.size(); i++)
+	{
+		if (nodes[i].isLeaf())
+			cost += nodes[i].aabb.area() * SAH_INTERSECTION_COST * nodes[i].triangleCount;
+		else
+			cost += nodes[i].aabb.area() * SAH_TRAVERSAL_COST;
+	}
+	return (float)(cost / rootArea);
+}
+
+float bvhBuildCost = 0.0f;
+
+// builds the BVH of the scene from the current position of its triangles
+void rebuild_scene_bvh(const BVHBuilder builder, const unsigned int maxLeafSize)
+{
+	// the spatial splits duplicate triangles, keep one copy of each
+	vector<unsigned char> seen;
+	size_t unique = 0;
+	for (size_t i = 0; i < triangles.size(); i++)
+	{
+		int id = triangles[i].id;
+		if (id >= (int)seen.size())
+			seen.resize(id + 1, 0);
+		if (seen[id])
+			continue;
+		seen[id] = 1;
+		triangles[unique++] = triangles[i];
+	}
+	triangles.resize(unique);
+
+	primitives.resize(triangles.size());
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < (int)triangles.size(); i++)
+		primitives[i] = make_primitive(triangles[i], i);
+
+	rootNodeId = build_bvh(bvh, triangles, primitives, builder, maxLeafSize);
+	bvhBuildCost = bvh_sah_cost(bvh);
+}
+
+// Update the acceleration structures of the scene after some triangles moved, changed[i] is true if triangles[i] moved.
+// The BVH is refit, and rebuilt if the refit degraded it too much.
+void update_scene_bvh(const vector<unsigned char>& changed, const BVHBuilder builder, const unsigned int maxLeafSize)
+{
+	refit_bvh(bvh, triangles, changed);
+	float cost = bvh_sah_cost(bvh);
+	printf("SAH cost %.2f, %.2f after the last build.\n", cost, bvhBuildCost);
+	if (cost > bvhBuildCost * BVH_REBUILD_THRESHOLD)
+		rebuild_scene_bvh(builder, maxLeafSize);
+
+	if (qbvh.empty() == false)
+		build_qbvh(qbvh, bvh);
+	if (compressedQbvh.empty() == false)
+		build_compressed_qbvh(compressedQbvh, bvh);
+	build_triangle_soa(triangleSoA, triangles);
+}
+
+// Animation of the triangles of a material of the mesh : rotation around the vertical axis through their center
+void animate_triangles(const Mesh& mesh, const int material, const float angle, const BVHBuilder builder, const unsigned int maxLeafSize)
+{
+	Vector center;
+	int count = 0;
+	for (int i = 0; i < mesh.triangle_count(); i++)
+	{
+		if (mesh.triangle_material_index(i) != material)
+			continue;
+		TriangleData data = mesh.triangle(i);
+		center = center + (Vector(data.a) + Vector(data.b) + Vector(data.c)) / 3.0f;
+		count++;
+	}
+	if (count == 0)
+		return;
+	center = center / (float)count;
+	Transform model = Translation(center) * RotationY(angle) * Translation(-center);
+	auto animate = [&](const int id)
+	{
+		TriangleData data = mesh.triangle(id);
+		vec3* positions[3] = { &data.a, &data.b, &data.c };
+		vec3* normals[3] = { &data.na, &data.nb, &data.nc };
+		for (int k = 0; k < 3; k++)
+		{
+			Point p = model(Point(*positions[k]));
+			Vector n = model(Vector(*normals[k]));
+			*positions[k] = vec3(p.x, p.y, p.z);
+			*normals[k] = vec3(n.x, n.y, n.z);
+		}
+		return data;
+	};
+
+	// the triangles are in the order of the leaves, their id is their index in the mesh
+	vector<unsigned char> changed(triangles.size(), 0);
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < (int)triangles.size(); i++)
+	{
+		int id = triangles[i].id;
+		if (mesh.triangle_material_index(id) != material)
+			continue;
+
+		triangles[i] = Triangle(animate(id), id);
+		changed[i] = 1;
+	}
+	update_scene_bvh(changed, builder, maxLeafSize);
+
+	// the emissive triangles of the material move too, the light tree is built again over their new positions
+	bool sourcesChanged = false;
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		int id = sources[i].id;
+		if (mesh.triangle_material_index(id) != material)
+			continue;
+
+		sources[i] = Source(animate(id), sources[i].emission, id);
+		sourcesChanged = true;
+	}
+	if (sourcesChanged)
+		build_light_tree(lightTree, sources);
+}
+
+// On-disk BVH cache
+// The triangles in the order of the leaves and the nodes of the BVH are stored in a binary file, next to the mesh. Its name
+// contains a hash of the content of the .obj file, of the build settings and of the cache version : a later run with the same
+// mesh and settings maps the file in memory and copies the arrays, without building the BVH.
+const unsigned int BVH_CACHE_VERSION = 1;
+
+struct BVHCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t triangleSize;		// sizeof(Triangle) and sizeof(BVHNode), the cache is not portable between builds of ray_tuto
+	uint32_t nodeSize;
+	uint32_t triangleCount;
+	uint32_t nodeCount;
+	float buildCost;
+	uint64_t key;
+};
+
+// FNV-1a, cf http://www.isthe.com/chongo/tech/comp/fnv/
+uint64_t hash_bytes(const unsigned char *data, const size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//! renvoie la cle du cache : le hash du fichier .obj et des parametres de construction, ou 0 si le fichier n'est pas lisible.
+uint64_t bvh_cache_key(const char *filename, const BVHBuilder builder, const unsigned int maxLeafSize)
+{
+	FILE *in = fopen(filename, "rb");
+	if (in == NULL)
+		return 0;
+
+	uint64_t hash = 14695981039346656037ULL;
+	vector<unsigned char> buffer(1 << 20);
+	size_t size;
+	while ((size = fread(buffer.data(), 1, buffer.size(), in)) > 0)
+		hash = hash_bytes(buffer.data(), size, hash);
+	fclose(in);
+
+	uint32_t settings[3] = { BVH_CACHE_VERSION, (uint32_t)builder, maxLeafSize };
+	return hash_bytes((const unsigned char *)settings, sizeof(settings), hash);
+}
+
+string bvh_cache_filename(const char *filename, const uint64_t key)
+{
+	char name[32];
+	sprintf(name, ".%016llx.bvh", (unsigned long long)key);
+	return string(filename) + name;
+}
+
+bool load_bvh_cache(const char *filename, const uint64_t key)
+{
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+#ifdef _WIN32
+	// no mmap, read the whole file
+	vector<unsigned char> buffer;
+	FILE *in = fopen(filename, "rb");
+	if (in == NULL)
+		return false;
+	fseek(in, 0, SEEK_END);
+	size_t size = (size_t)ftell(in);
+	fseek(in, 0, SEEK_SET);
+	buffer.resize(size);
+	bool read = (fread(buffer.data(), 1, size, in) == size);
+	fclose(in);
+	if (read == false)
+		return false;
+	const unsigned char *data = buffer.data();
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(BVHCacheHeader))
+	{
+		close(fd);
+		return false;
+	}
+	size_t size = (size_t)info.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+	const unsigned char *data = (const unsigned char *)mapping;
+#endif
+
+	BVHCacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	bool valid = size >= sizeof(header)
+		&& memcmp(header.magic, "RAYBVH\0\0", 8) == 0
+		&& header.version == BVH_CACHE_VERSION
+		&& header.key == key
+		&& header.triangleSize == sizeof(Triangle)
+		&& header.nodeSize == sizeof(BVHNode)
+		&& size == sizeof(header) + header.triangleCount * sizeof(Triangle) + header.nodeCount * sizeof(BVHNode)
+		&& header.nodeCount > 0;
+	if (valid)
+	{
+		const unsigned char *p = data + sizeof(header);
+		triangles.resize(header.triangleCount);
+		memcpy(triangles.data(), p, header.triangleCount * sizeof(Triangle));
+		p += header.triangleCount * sizeof(Triangle);
+		bvh.assign(header.nodeCount, BVHNode(AABB(), 0, 0));
+		memcpy(bvh.data(), p, header.nodeCount * sizeof(BVHNode));
+		primitives.clear();
+		rootNodeId = 0;
+		bvhBuildCost = header.buildCost;
+	}
+
+#ifndef _WIN32
+	munmap(mapping, size);
+#endif
+	if (valid == false)
+		return false;
+
+	int elapsed = (int)chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count();
+	printf("%d triangles, %d BVH nodes read from cache '%s', %dms.\n", (int)triangles.size(), (int)bvh.size(), filename, elapsed);
+	return true;
+}
+
+bool save_bvh_cache(const char *filename, const uint64_t key)
+{
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "RAYBVH\0\0", 8);
+	header.version = BVH_CACHE_VERSION;
+	header.triangleSize = sizeof(Triangle);
+	header.nodeSize = sizeof(BVHNode);
+	header.triangleCount = (uint32_t)triangles.size();
+	header.nodeCount = (uint32_t)bvh.size();
+	header.buildCost = bvhBuildCost;
+	header.key = key;
+
+	FILE *out = fopen(filename, "wb");
+	if (out == NULL)
+	{
+		printf("[error] writing BVH cache '%s'...\n", filename);
+		return false;
+	}
+	bool written = fwrite(&header, sizeof(header), 1, out) == 1
+		&& fwrite(triangles.data(), sizeof(Triangle), triangles.size(), out) == triangles.size()
+		&& fwrite(bvh.data(), sizeof(BVHNode), bvh.size(), out) == bvh.size();
+	fclose(out);
+	if (written == false)
+	{
+		printf("[error] writing BVH cache '%s'...\n", filename);
+		remove(filename);
+	}
+	return written;
+}
+
+const unsigned int N = 256;
+const BVHBuilder bvhBuilder = BVH_SAH_PARALLEL;			// BVH_MIDDLE, BVH_SAH, BVH_SAH_PARALLEL or BVH_SBVH
+const unsigned int bvhLeafSize = 4;
+const BVHTraversal bvhTraversal = TRAVERSAL_QBVH;		// TRAVERSAL_BVH2, TRAVERSAL_QBVH or TRAVERSAL_QBVH_COMPRESSED
+const bool usePackets = true;
+const bool castShadows = true;
+
+const unsigned int progressivePassSamples = 8;
+const unsigned int progressiveMinSamples = 32;
+const float animationStep = 10.0f;			// rotation of the animated triangles between 2 frames, in degrees
+
+// Options of the render : ray_tuto [-spp n] [-sampler random|sobol|r2] [-seed n]
+//	[-lights n] [-mode fixed|progressive] [-tolerance t] [-error e] [-time seconds] [-save passes]
+//	[-threads n] [-tile size] [-order scanline|morton|hilbert] [-instances file]
+//	[-frames n] [-animate material] [-cache on|off] [-denoise levels] [-strength s] [-ao legacy|cosine|cache] [-radius r]
+//	[-ao-error a] [-wavefront off|on|sorted] [-width w] [-height h] [-stream on|off]
+//	[-workers n] [-port p] [-worker host:port] [-bucket size] [-timeout seconds]
+// -stream on writes the rows of the image while they are rendered, for the images larger than the memory : the hdr file
+// is run length encoded and is the format of these renders, the png file is not compressed, about 3 bytes per pixel.
+struct RenderOptions
+{
+	unsigned int samples = N;				// samples per pixel, maximum number in progressive mode
+	SamplerType sampler = SAMPLER_SOBOL;
+	unsigned int seed = 0;
+	unsigned int lightSamples = 0;			// samples of the emissive sources per pixel, 0 : point light
+
+	bool progressive = false;
+	float tolerance = 0.02f;				// error under which a pixel stops sampling
+	float targetError = 0.0f;				// mean error of the image stopping the render, 0 : none
+	float timeBudget = 0.0f;				// in seconds, 0 : none
+	unsigned int savePasses = 0;			// write the image every n passes, 0 : never
+
+	int width = 512;
+	int height = 512;
+	bool stream = false;					// write the bands of the image while they are rendered, cf ImageStream, use the hdr file
+
+	int workers = 0;						// local worker processes started by the coordinator, cf render_distributed()
+	int port = 0;							// port of the coordinator on every interface, 0 : any free port of the loopback interface, or no coordinator without workers
+	string worker;							// host:port of the coordinator, for a worker process
+	int bucketSize = 128;					// in pixels, rounded to a multiple of PACKET_SIZE
+	float workerTimeout = 60.0f;			// in seconds, a worker that does not answer in time is lost, 0 : no limit
+
+	int threads = 0;						// 0 : one thread per core
+	int tileSize = 32;						// in pixels, rounded to a multiple of PACKET_SIZE
+	TileOrder tileOrder = ORDER_HILBERT;	// order of the tiles in the image and of the blocks in a tile
+
+	string instances;						// scene of instances, cf read_instances(), instead of the cornell box
+
+	int frames = 1;
+	int animatedMaterial = -1;				// index of the material of the triangles that move in the animation, -1 : none
+	bool cache = true;						// read the BVH from its cache file, or write it after the build
+
+	AOMode ao = AO_LEGACY;					// cosine : cosine weighted directions in the hemisphere, limited to aoRadius
+	float aoRadius = 1.0f;					// 0 : not limited
+	float aoCacheError = 0.2f;				// tolerance of the interpolation of the ambient occlusion cache
+
+	bool wavefront = false;					// render by stages of rays instead of by pixel, cf render_wavefront()
+	bool wavefrontSort = false;				// sort the secondary rays of the stages
+
+	int denoiseLevels = 0;					// levels of the a-trous filter, 0 : no denoising, 5 : filter width 64 pixels
+	float denoiseStrength = 1.0f;			// tolerance of the filter on the illumination differences
+};
+
+bool parse_options(int argc, char **argv, RenderOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string option = argv[i];
+		if (i + 1 >= argc)
+		{
+			printf("[error] missing value for option '%s'\n", option.c_str());
+			return false;
+		}
+
+		string value = argv[++i];
+		if (option == "-spp")
+			options.samples = std::max(atoi(value.c_str()), 1);
+		else if (option == "-seed")
+			options.seed = (unsigned int)strtoul(value.c_str(), NULL, 10);
+		else if (option == "-sampler" && value == "random")
+			options.sampler = SAMPLER_RANDOM;
+		else if (option == "-sampler" && value == "sobol")
+			options.sampler = SAMPLER_SOBOL;
+		else if (option == "-sampler" && value == "r2")
+			options.sampler = SAMPLER_R2;
+		else if (option == "-lights")
+			options.lightSamples = std::max(atoi(value.c_str()), 0);
+		else if (option == "-mode" && value == "fixed")
+			options.progressive = false;
+		else if (option == "-mode" && value == "progressive")
+			options.progressive = true;
+		else if (option == "-tolerance")
+			options.tolerance = std::max((float)atof(value.c_str()), 0.0f);
+		else if (option == "-error")
+			options.targetError = std::max((float)atof(value.c_str()), 0.0f);
+		else if (option == "-time")
+			options.timeBudget = std::max((float)atof(value.c_str()), 0.0f);
+		else if (option == "-width")
+			options.width = std::max(atoi(value.c_str()), 1);
+		else if (option == "-height")
+			options.height = std::max(atoi(value.c_str()), 1);
+		else if (option == "-stream" && value == "on")
+			options.stream = true;
+		else if (option == "-stream" && value == "off")
+			options.stream = false;
+		else if (option == "-workers")
+			options.workers = std::max(atoi(value.c_str()), 0);
+		else if (option == "-port")
+			options.port = std::max(atoi(value.c_str()), 0);
+		else if (option == "-worker")
+			options.worker = value;
+		else if (option == "-bucket")
+			options.bucketSize = std::max(atoi(value.c_str()), 1);
+		else if (option == "-timeout")
+			options.workerTimeout = std::max((float)atof(value.c_str()), 0.0f);
+		else if (option == "-threads")
+			options.threads = std::max(atoi(value.c_str()), 0);
+		else if (option == "-tile")
+			options.tileSize = std::max(atoi(value.c_str()), 1);
+		else if (option == "-order" && value == "scanline")
+			options.tileOrder = ORDER_SCANLINE;
+		else if (option == "-order" && value == "morton")
+			options.tileOrder = ORDER_MORTON;
+		else if (option == "-order" && value == "hilbert")
+			options.tileOrder = ORDER_HILBERT;
+		else if (option == "-instances")
+			options.instances = value;
+		else if (option == "-frames")
+			options.frames = std::max(atoi(value.c_str()), 1);
+		else if (option == "-animate")
+			options.animatedMaterial = atoi(value.c_str());
+		else if (option == "-cache" && value == "on")
+			options.cache = true;
+		else if (option == "-cache" && value == "off")
+			options.cache = false;
+		else if (option == "-ao" && value == "legacy")
+			options.ao = AO_LEGACY;
+		else if (option == "-ao" && value == "cosine")
+			options.ao = AO_COSINE;
+		else if (option == "-ao" && value == "cache")
+			options.ao = AO_CACHE;
+		else if (option == "-ao-error")
+			options.aoCacheError = std::max((float)atof(value.c_str()), 1e-3f);
+		else if (option == "-radius")
+			options.aoRadius = std::max((float)atof(value.c_str()), 0.0f);
+		else if (option == "-wavefront" && value == "off")
+			options.wavefront = false;
+		else if (option == "-wavefront" && (value == "on" || value == "sorted"))
+		{
+			options.wavefront = true;
+			options.wavefrontSort = (value == "sorted");
+		}
+		else if (option == "-denoise")
+			options.denoiseLevels = std::min(std::max(atoi(value.c_str()), 0), 5);
+		else if (option == "-strength")
+			options.denoiseStrength = std::max((float)atof(value.c_str()), 0.0f);
+		else if (option == "-save")
+			options.savePasses = std::max(atoi(value.c_str()), 0);
+		else
+		{
+			printf("[error] unknown option '%s %s'\n", option.c_str(), value.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// Point light placed at the camera, its intensity decreases linearly up to radius
+struct PointLight
+{
+	Point position;
+	float radius;
+	float intensity;
+};
+
+// Direct lighting of a hit, by the sources of the scene or by the point light. The shadow ray towards the point light is
+// traced here, or returned in shadow when it is not null, with tmax = 0 when the point light does not light the hit.
+Color GetDirectLighting(const Hit& hit, const int x, const int y, Mesh& mesh, const RenderOptions& options, const PointLight& light,
+	Color& albedo, Ray *shadow = nullptr)
+{
+	if (shadow != nullptr)
+		shadow->tmax = 0.0f;
+
+	if (options.lightSamples > 0)
+	{
+		// eclairage direct par les sources de la scene, avec une sequence independante de celle de l'occultation ambiante
+		Sampler lightSampler(options.sampler, x, y, ~options.seed);
+		const Material& material = hit_mesh(mesh, hit).triangle_material(hit.object_id);
+		albedo = material.diffuse;
+		return material.emission + GetSourcesLighting(hit, material.diffuse, options.lightSamples, lightSampler);
+	}
+
+	// calculer l'eclairage direct pour chaque source
+	Vector lightDir = normalize(hit.p - light.position);
+	float diffuseTerm = std::max(dot(-lightDir, hit.n), 0.0f)
+		* (1.0f - (length(hit.p - light.position) / light.radius))
+		* light.intensity;
+
+	// Shadow ray towards the light, the segment stops just before the light
+	if (castShadows && diffuseTerm > 0.0f)
+	{
+		Ray ray(hit.p + 0.001f * hit.n, light.position);
+		if (shadow != nullptr)
+		{
+			*shadow = ray;
+			shadow->tmax = 1.0f - EPSILON;
+		}
+		else if (occluded(ray, 1.0f - EPSILON))
+			diffuseTerm = 0.0f;
+	}
+	albedo = hitColor(hit_mesh(mesh, hit), hit);
+	return albedo * diffuseTerm;
+}
+
+// Guides of the denoiser : albedo, normal and distance to the camera of the hit of the pixel
+void write_guides(Image& albedoBuffer, Image& normalBuffer, Image& depthBuffer, const int x, const int y, const Point& camera,
+	const Hit& hit, const Color& albedo)
+{
+	Vector n = normalize(hit.n);
+	albedoBuffer(x, y) = Color(albedo, 1);
+	normalBuffer(x, y) = Color(n.x, n.y, n.z, 1);
+	float d = distance(camera, hit.p);
+	depthBuffer(x, y) = Color(d, d, d, 1);
+}
+
+// Progressive render
+// Running estimate of the ambient occlusion of a pixel, cf Welford's online variance
+struct PixelEstimate
+{
+	Hit hit;
+	Color direct;		// direct lighting, without the ambient occlusion
+	Sampler sampler;
+	AOFrame frame;		// directions of the cosine weighted ambient occlusion
+	unsigned int count;
+	float mean;
+	float m2;
+	bool active;
+
+	PixelEstimate() : hit(), direct(), sampler(SAMPLER_RANDOM, 0, 0, 0), count(0), mean(0), m2(0), active(false) {}
+	PixelEstimate(const Hit& _hit, const Color& _direct, const Sampler& _sampler)
+		: hit(_hit), direct(_direct), sampler(_sampler), count(0), mean(0), m2(0),
+		active(std::max(_direct.r, std::max(_direct.g, _direct.b)) > 0.0f)
+	{
+		if (aoMode == AO_COSINE)
+			frame = make_ao_frame(hit, sampler);
+	}
+
+	void add(const float sample)
+	{
+		count++;
+		float delta = sample - mean;
+		mean += delta / count;
+		m2 += delta * (sample - mean);
+	}
+
+	//! renvoie l'erreur de l'estimation du pixel, l'ecart type de la moyenne relatif a la valeur du pixel, ou au blanc pour les pixels sombres.
+	float error() const
+	{
+		if (count < 2)
+			return FLT_MAX;
+		float scale = std::max(direct.r, std::max(direct.g, direct.b));
+		float variance = m2 / (float)((count - 1) * count);
+		if (m2 <= 0.0f)
+		{
+			// all the samples are equal, typically all visible or all occluded : the variance is unknown, it is bounded by
+			// a Bernoulli variable whose rare value was not drawn yet, p = 1 / (n + 1), cf the rule of three
+			if (count < progressiveMinSamples)
+				return FLT_MAX;
+			float p = 1.0f / (count + 1);
+			float range = aoMode == AO_LEGACY ? (float)M_PI : 1.0f;
+			variance = p * (1.0f - p) * range * range / count;
+		}
+		float deviation = sqrt(variance) * scale;
+		return deviation / std::max(mean * scale, 1.0f);
+	}
+};
+
+#ifdef RAY_STATS
+// Traversal costs of the pixels of the frame : the box and triangle tests of all the rays of a pixel
+vector<RayStats> pixelStats;
+
+// False colour ramp, from black to blue, green, yellow and red
+Color heat_color(const float v)
+{
+	const Color ramp[5] = { Color(0, 0, 0), Color(0, 0, 1), Color(0, 1, 0), Color(1, 1, 0), Color(1, 0, 0) };
+	float x = std::min(std::max(v, 0.0f), 1.0f) * 4;
+	int i = std::min((int)x, 3);
+	float t = x - i;
+	return Color(ramp[i] * (1 - t) + ramp[i + 1] * t, 1);
+}
+
+// Heatmap of the cost of the pixels, next to the render, scaled so the 99th percentile is red, and a summary of the frame
+void write_stats(const int width, const int height, const int frame = -1)
+{
+	vector<float> costs(pixelStats.size());
+	RayStats total;
+	for (size_t i = 0; i < pixelStats.size(); i++)
+	{
+		costs[i] = (float)(pixelStats[i].boxes + pixelStats[i].triangles);
+		total.add(pixelStats[i]);
+	}
+	if (costs.empty())
+		return;
+
+	vector<float> sorted = costs;
+	size_t p99 = std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+	std::nth_element(sorted.begin(), sorted.begin() + p99, sorted.end());
+	float scale = sorted[p99] > 0 ? 1.0f / sorted[p99] : 0.0f;
+
+	Image heatmap(width, height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			heatmap(x, y) = heat_color(costs[y * width + x] * scale);
+
+	char filename[1024];
+	if (frame < 0)
+		sprintf(filename, "m2tp/TutoRayTrace/render_cost.png");
+	else
+		sprintf(filename, "m2tp/TutoRayTrace/render_%03d_cost.png", frame);
+	write_image(heatmap, filename);
+
+	double n = (double)pixelStats.size();
+	printf("per pixel : %.1f rays, %.1f nodes, %.1f box tests, %.1f triangle tests, max stack depth %u\n",
+		total.rays / n, total.nodes / n, total.boxes / n, total.triangles / n, total.depth);
+	printf("cost per pixel (box + triangle tests) : average %.1f, p99 %.1f, heatmap '%s'\n",
+		(total.boxes + (double)total.triangles) / n, sorted[p99], filename);
+}
+#endif
+
+// the frames of an animation are numbered, render_000.png, etc.
+// Files of the render : render.png and render.hdr, or render_<frame>.png and .hdr for an animation
+string render_filename(const char *extension, const int frame = -1)
+{
+	char filename[1024];
+	if (frame < 0)
+		sprintf(filename, "m2tp/TutoRayTrace/render.%s", extension);
+	else
+		sprintf(filename, "m2tp/TutoRayTrace/render_%03d.%s", frame, extension);
+	return filename;
+}
+
+void write_render(const Image& image, const int frame = -1)
+{
+	write_image(image, render_filename("png", frame).c_str());
+	write_image_hdr(image, render_filename("hdr", frame).c_str());
+}
+
+// Denoised render and the auxiliary buffers that guide the filter : albedo, normal and depth of the primary hits
+void write_denoised(const Image& image, const Image& albedo, const Image& normals, const Image& depth, const int frame = -1)
+{
+	char prefix[256];
+	if (frame < 0)
+		sprintf(prefix, "m2tp/TutoRayTrace/render");
+	else
+		sprintf(prefix, "m2tp/TutoRayTrace/render_%03d", frame);
+
+	char filename[1024];
+	sprintf(filename, "%s_denoised.png", prefix);
+	write_image(image, filename);
+	sprintf(filename, "%s_denoised.hdr", prefix);
+	write_image_hdr(image, filename);
+	sprintf(filename, "%s_albedo.png", prefix);
+	write_image(albedo, filename);
+	sprintf(filename, "%s_normal.png", prefix);
+	write_image(normals, filename);
+	sprintf(filename, "%s_depth.hdr", prefix);
+	write_image_hdr(depth, filename);
+}
+
+// Add progressivePassSamples ambient occlusion samples to every pixel that is not converged yet, until all pixels
+// converge, the mean error of the image reaches the target or the time budget runs out
+struct PassStats
+{
+	int active = 0;
+	int shaded = 0;
+	double error = 0.0;
+	double samples = 0.0;
+};
+
+void render_progressive(Image& image, vector<PixelEstimate>& estimates, TileScheduler& scheduler, const RenderOptions& options)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	const int width = image.width();
+	const int height = image.height();
+	for (int pass = 1; ; pass++)
+	{
+		// one set of counters per thread, summed at the end of the pass
+		vector<PassStats> threadStats(scheduler.threads());
+		scheduler.run(width, height, PACKET_SIZE, [&](const Tile& cell, const int thread)
+		{
+			PassStats stats;
+			for (int y = cell.y; y < cell.y + cell.height; y++)
+			{
+				for (int x = cell.x; x < cell.x + cell.width; x++)
+				{
+					PixelEstimate& e = estimates[y * width + x];
+					if (e.active)
+					{
+						RAY_STAT(rayStats = RayStats());
+						for (unsigned int s = 0; s < progressivePassSamples && e.count < options.samples; s++)
+							e.add(aoMode == AO_COSINE ? GetCosineOcclusionSample(e.frame, e.count) : GetAmbientOcclusionSample(e.hit, e.count, 0, e.sampler));
+						RAY_STAT(pixelStats[y * width + x].add(rayStats));
+
+						if (e.count >= options.samples || (e.count >= progressiveMinSamples && e.error() <= options.tolerance))
+							e.active = false;
+						image(x, y) = Color(e.direct * e.mean, 1);
+					}
+
+					if (e.hit.object_id != -1)
+					{
+						stats.shaded++;
+						stats.samples += e.count;
+						// the pixels that can not estimate their error yet count as fully wrong
+						float pixelError = e.error();
+						if (pixelError < FLT_MAX)
+							stats.error += std::min(pixelError, 1.0f);
+						else if (e.active)
+							stats.error += 1.0f;
+					}
+					if (e.active)
+						stats.active++;
+				}
+			}
+
+			PassStats& total = threadStats[thread];
+			total.active += stats.active;
+			total.shaded += stats.shaded;
+			total.error += stats.error;
+			total.samples += stats.samples;
+		});
+
+		int active = 0;
+		int shaded = 0;
+		double error = 0.0;
+		double samples = 0.0;
+		for (size_t i = 0; i < threadStats.size(); i++)
+		{
+			active += threadStats[i].active;
+			shaded += threadStats[i].shaded;
+			error += threadStats[i].error;
+			samples += threadStats[i].samples;
+		}
+
+		float elapsed = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+		float meanError = shaded ? (float)(error / shaded) : 0.0f;
+		printf("pass %d: %d active pixels, %.1f samples per pixel, error %.4f, %.2fs\n",
+			pass, active, shaded ? samples / shaded : 0.0, meanError, elapsed);
+
+		bool done = (active == 0)
+			|| (options.targetError > 0.0f && meanError <= options.targetError)
+			|| (options.timeBudget > 0.0f && elapsed >= options.timeBudget);
+		if (done)
+			break;
+		if (options.savePasses > 0 && pass % options.savePasses == 0)
+			write_render(image);
+	}
+}
+
+// Wavefront render
+// The render runs in stages instead of following each pixel from its primary ray to its last ambient occlusion ray :
+// the rays of a stage are stored in a queue, the queue is traced by all the threads, then the results are shaded and
+// produce the queue of the next stage : primary rays, shadow rays towards the point light, ambient occlusion rays.
+// The secondary rays can be sorted by the octant of their direction and the position of their origin along a Morton curve,
+// so the consecutive rays visit the same nodes of the BVH. The results are stored in the slot of each ray, the pixels sum
+// their samples in the same order as the render by pixel, the image is the same.
+// The ambient occlusion rays of all the pixels do not fit in memory, the pixels are processed in groups that fill a queue.
+// The AO cache, the progressive mode and the cost heatmap need the render by pixel.
+const int WAVEFRONT_QUEUE_RAYS = 1 << 20;
+const int WAVEFRONT_CHUNK = 256;		// rays traced by a thread before it takes the next ones
+
+// Rays of a stage, structure of arrays
+struct RayQueue
+{
+	vector<float> ox, oy, oz;
+	vector<float> dx, dy, dz;
+	vector<float> tmax;
+	vector<int> slot;	//!< indice du resultat du rayon, les rayons tries gardent leur indice.
+	int count = 0;
+
+	void resize(const int n)
+	{
+		ox.resize(n); oy.resize(n); oz.resize(n);
+		dx.resize(n); dy.resize(n); dz.resize(n);
+		tmax.resize(n);
+		slot.resize(n);
+		count = n;
+	}
+
+	void set(const int i, const Ray& ray, const float t, const int s)
+	{
+		ox[i] = ray.o.x; oy[i] = ray.o.y; oz[i] = ray.o.z;
+		dx[i] = ray.d.x; dy[i] = ray.d.y; dz[i] = ray.d.z;
+		tmax[i] = t;
+		slot[i] = s;
+	}
+
+	void copy(const int i, const RayQueue& queue, const int j)
+	{
+		ox[i] = queue.ox[j]; oy[i] = queue.oy[j]; oz[i] = queue.oz[j];
+		dx[i] = queue.dx[j]; dy[i] = queue.dy[j]; dz[i] = queue.dz[j];
+		tmax[i] = queue.tmax[j];
+		slot[i] = queue.slot[j];
+	}
+
+	Ray ray(const int i) const
+	{
+		Ray r(Point(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i]));
+		r.tmax = tmax[i];
+		return r;
+	}
+};
+
+// Calls f(begin, end) on ranges of count items, the threads take the next range when they finish one
+template <typename F>
+void parallel_chunks(ThreadPool& pool, const int count, const int chunk, const F& f)
+{
+	std::atomic<int> next(0);
+	pool.run([&](const int thread)
+	{
+		for (int begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk))
+			f(begin, std::min(begin + chunk, count));
+	});
+}
+
+// Spreads the 10 low bits of v, 2 zeros between each bit
+uint32_t spread_bits(uint32_t v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// Sorts the queue by octant of the directions, then by Morton code of the origins on a 128^3 grid over bounds,
+// 24 bits keys, radix sort on 2 digits of 12 bits
+void sort_rays(ThreadPool& pool, RayQueue& queue, RayQueue& sorted, const AABB& bounds)
+{
+	const int n = queue.count;
+	vector<uint32_t> keys(n);
+	Vector extent(bounds.minPoint, bounds.maxPoint);
+	Vector scale(extent.x > 0 ? 127.0f / extent.x : 0.0f, extent.y > 0 ? 127.0f / extent.y : 0.0f, extent.z > 0 ? 127.0f / extent.z : 0.0f);
+	parallel_chunks(pool, n, 4096, [&](const int begin, const int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			uint32_t octant = (queue.dx[i] < 0 ? 1 : 0) | (queue.dy[i] < 0 ? 2 : 0) | (queue.dz[i] < 0 ? 4 : 0);
+			uint32_t x = (uint32_t)std::min(std::max((queue.ox[i] - bounds.minPoint.x) * scale.x, 0.0f), 127.0f);
+			uint32_t y = (uint32_t)std::min(std::max((queue.oy[i] - bounds.minPoint.y) * scale.y, 0.0f), 127.0f);
+			uint32_t z = (uint32_t)std::min(std::max((queue.oz[i] - bounds.minPoint.z) * scale.z, 0.0f), 127.0f);
+			keys[i] = (octant << 21) | (spread_bits(z) << 2) | (spread_bits(y) << 1) | spread_bits(x);
+		}
+	});
+
+	// the histograms of the 2 digits are counted together, the indices move between 2 buffers
+	vector<int> offsets(2 * 4097, 0);
+	for (int i = 0; i < n; i++)
+	{
+		offsets[(keys[i] & 0xfff) + 1]++;
+		offsets[4097 + (keys[i] >> 12) + 1]++;
+	}
+	for (int d = 0; d < 4096; d++)
+	{
+		offsets[d + 1] += offsets[d];
+		offsets[4097 + d + 1] += offsets[4097 + d];
+	}
+
+	vector<int> low(n), order(n);
+	for (int i = 0; i < n; i++)
+		low[offsets[keys[i] & 0xfff]++] = i;
+	for (int i = 0; i < n; i++)
+	{
+		int index = low[i];
+		order[offsets[4097 + (keys[index] >> 12)]++] = index;
+	}
+
+	sorted.resize(n);
+	parallel_chunks(pool, n, 4096, [&](const int begin, const int end)
+	{
+		for (int i = begin; i < end; i++)
+			sorted.copy(i, queue, order[i]);
+	});
+}
+
+// Visibility of the rays of the queue, occluded is indexed by the slots of the rays
+void trace_occluded(ThreadPool& pool, const RayQueue& queue, vector<unsigned char>& occludedRays)
+{
+	parallel_chunks(pool, queue.count, WAVEFRONT_CHUNK, [&](const int begin, const int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			Ray ray = queue.ray(i);
+			occludedRays[queue.slot[i]] = occluded(ray, ray.tmax);
+		}
+	});
+}
+
+// Closest hits of the primary rays, the queue holds blocks of PACKET_RAYS rays traced as packets
+// The rays blocks[b] .. blocks[b + 1] - 1 of the queue belong to the same block of pixels and are traced as one packet,
+// the blocks on the right and bottom edges of the image are not full
+void trace_primary(ThreadPool& pool, const RayQueue& queue, const vector<int>& blocks, vector<Hit>& hits)
+{
+	parallel_chunks(pool, (int)blocks.size() - 1, 1, [&](const int first, const int last)
+	{
+		for (int b = first; b < last; b++)
+		{
+			RayPacket packet;
+			for (int i = blocks[b]; i < blocks[b + 1]; i++)
+				packet.add(queue.ray(i));
+
+			Hit packetHits[PACKET_RAYS];
+			if (usePackets && traversal != TRAVERSAL_INSTANCES)
+				intersect_packet(packet, packetHits);
+			else
+			{
+				for (int i = 0; i < packet.count; i++)
+				{
+					packetHits[i].t = packet.rays[i].tmax;
+					intersect_scene(packet.rays[i], packetHits[i]);
+				}
+			}
+			for (int i = 0; i < packet.count; i++)
+				hits[queue.slot[blocks[b] + i]] = packetHits[i];
+		}
+	});
+}
+
+double seconds_since(const std::chrono::high_resolution_clock::time_point& start)
+{
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void render_wavefront(Image& image, const Point& o, const Point& dO, const Vector& dx, const Vector& dy, Mesh& mesh,
+	const PointLight& light, ThreadPool& pool, const RenderOptions& options, const AABB& bounds,
+	Image& albedoBuffer, Image& normalBuffer, Image& depthBuffer)
+{
+	const int width = image.width();
+	const int height = image.height();
+	RayQueue queue, sorted;
+	double traceTime = 0.0;
+	double sortTime = 0.0;
+	long long rays = 0;
+
+	// primary rays, by blocks of PACKET_SIZE x PACKET_SIZE pixels, the slot of a ray is its pixel
+	queue.resize(width * height);
+	int count = 0;
+	vector<int> blocks;
+	for (int by = 0; by < height; by += PACKET_SIZE)
+		for (int bx = 0; bx < width; bx += PACKET_SIZE)
+		{
+			blocks.push_back(count);
+			for (int y = by; y < std::min(by + PACKET_SIZE, height); y++)
+				for (int x = bx; x < std::min(bx + PACKET_SIZE, width); x++)
+				{
+					Point e = dO + x * dx + y * dy;
+					queue.set(count++, Ray(o, e), 1.0f, y * width + x);
+				}
+		}
+	blocks.push_back(count);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	vector<Hit> hits(width * height);
+	trace_primary(pool, queue, blocks, hits);
+	traceTime += seconds_since(start);
+	rays += queue.count;
+
+	// direct lighting, the shadow rays of the point light are collected in a queue
+	vector<Color> direct(width * height);
+	vector<Ray> shadows(width * height);
+	parallel_chunks(pool, width * height, width, [&](const int begin, const int end)
 	{
-		return (p.center(axe) < coupe);
+		for (int i = begin; i < end; i++)
+		{
+			const Hit& hit = hits[i];
+			if (hit.object_id == -1)
+				continue;
+			int x = i % width;
+			int y = i / width;
+			Color albedo;
+			direct[i] = GetDirectLighting(hit, x, y, mesh, options, light, albedo, &shadows[i]);
+			if (options.denoiseLevels > 0)
+				write_guides(albedoBuffer, normalBuffer, depthBuffer, x, y, o, hit, albedo);
+		}
+	});
+
+	queue.resize(width * height);
+	count = 0;
+	for (int i = 0; i < width * height; i++)
+		if (shadows[i].tmax > 0.0f)
+			queue.set(count++, shadows[i], shadows[i].tmax, i);
+	queue.count = count;
+
+	start = std::chrono::high_resolution_clock::now();
+	const RayQueue *shadowQueue = &queue;
+	if (options.wavefrontSort)
+	{
+		sort_rays(pool, queue, sorted, bounds);
+		shadowQueue = &sorted;
+		sortTime += seconds_since(start);
+	}
+	vector<unsigned char> occludedRays(width * height);
+	trace_occluded(pool, *shadowQueue, occludedRays);
+	traceTime += seconds_since(start);
+	rays += count;
+	for (int i = 0; i < width * height; i++)
+		if (shadows[i].tmax > 0.0f && occludedRays[i])
+			direct[i] = Color(0, 0, 0);
+
+	// ambient occlusion of the lit pixels, by groups of pixels filling a queue
+	vector<int> pixels;
+	for (int i = 0; i < width * height; i++)
+	{
+		if (hits[i].object_id == -1)
+			continue;
+		if (direct[i].r != 0.0f || direct[i].g != 0.0f || direct[i].b != 0.0f)
+			pixels.push_back(i);
+		else
+			image(i % width, i / width) = Color(0, 0, 0, 1);
+	}
+
+	const int samples = options.samples;
+	const int group = std::max(WAVEFRONT_QUEUE_RAYS / samples, 1);
+	vector<float> weights;
+	for (int first = 0; first < (int)pixels.size(); first += group)
+	{
+		int n = std::min(group, (int)pixels.size() - first);
+		queue.resize(n * samples);
+		weights.resize(n * samples);
+		occludedRays.resize(n * samples);
+
+		// the samples of a pixel use the same sequence as GetAmbientOcclusionTerm()
+		parallel_chunks(pool, n, 16, [&](const int begin, const int end)
+		{
+			for (int p = begin; p < end; p++)
+			{
+				int pixel = pixels[first + p];
+				const Hit& hit = hits[pixel];
+				Sampler sampler(options.sampler, pixel % width, pixel / width, options.seed);
+				if (aoMode == AO_COSINE)
+				{
+					AOFrame frame = make_ao_frame(hit, sampler);
+					float tmax = aoRadius > 0.0f ? aoRadius : FLT_MAX;
+					for (int s = 0; s < samples; s++)
+					{
+						int slot = p * samples + s;
+						queue.set(slot, Ray(frame.origin, GetCosineOcclusionDirection(frame, s)), tmax, slot);
+						weights[slot] = 1.0f;
+					}
+				}
+				else
+				{
+					for (int s = 0; s < samples; s++)
+					{
+						int slot = p * samples + s;
+						Vector d = GetAmbientOcclusionDirection(s, samples, sampler);
+						queue.set(slot, Ray(hit.p + 0.001f * hit.n, d), FLT_MAX, slot);
+						weights[slot] = dot(d, hit.n) * M_PI;
+					}
+				}
+			}
+		});
+
+		start = std::chrono::high_resolution_clock::now();
+		const RayQueue *aoQueue = &queue;
+		if (options.wavefrontSort)
+		{
+			sort_rays(pool, queue, sorted, bounds);
+			aoQueue = &sorted;
+			sortTime += seconds_since(start);
+		}
+		trace_occluded(pool, *aoQueue, occludedRays);
+		traceTime += seconds_since(start);
+		rays += queue.count;
+
+		parallel_chunks(pool, n, 64, [&](const int begin, const int end)
+		{
+			for (int p = begin; p < end; p++)
+			{
+				float accumulator = 0.0f;
+				for (int s = 0; s < samples; s++)
+					accumulator += occludedRays[p * samples + s] ? 0.0f : weights[p * samples + s];
+				int pixel = pixels[first + p];
+				float ambientTerm = accumulator / (float)samples;
+				image(pixel % width, pixel / width) = Color(direct[pixel] * ambientTerm, 1);
+			}
+		});
+	}
+
+	// the trace stages include the sorts
+	printf("wavefront: %lld rays, %.1f Mrays/s in the trace stages, sort %.0fms\n", rays, rays / traceTime / 1e6, sortTime * 1000.0);
+}
+
+// Distributed render
+// The coordinator cuts the image in buckets and sends them to worker processes over tcp sockets, the workers render the
+// buckets with their own threads and send the pixels back. The workers are ray_tuto processes started with the same
+// options and -worker host:port, by the coordinator itself with -workers n, or by hand on other machines. They read the
+// BVH from the same cache file as the coordinator : a worker on another machine needs a copy of the cache file, or builds
+// the BVH again with the same builder and leaf size. A worker whose scene, render options or BVH are not the same is
+// refused, the scene is identified by a hash of its files, with or without the cache.
+// The coordinator listens on the loopback interface for its local workers, and on every interface when -port is given.
+// A worker renders one bucket at a time : when its connection is lost, or when it does not answer before the timeout,
+// its bucket goes back to the queue. The coordinator renders the buckets itself when no worker is connected.
+// The pixels of a bucket do not depend on the process that renders them, the image is the same as the local render.
+// The messages are written in the byte order of the machine, all the workers are expected to run the same build.
+const uint32_t WORKER_MAGIC = 0x57594152;	// "RAYW"
+const int WORKER_VERSION = 3;
+const float WORKER_WAIT = 5.0f;			// time in seconds without any worker before the coordinator renders a bucket itself
+
+// Scene loaded by a process and options of its render, the coordinator and its workers must use the same ones
+struct SceneSignature
+{
+	uint32_t magic = WORKER_MAGIC;
+	int32_t version = WORKER_VERSION;
+	uint64_t key = 0;			// cf bvh_cache_key(), of the .obj file, or of the instances file and of its meshes
+	uint64_t nodes = 0;
+	uint64_t triangles = 0;
+
+	uint32_t samples = 0;
+	uint32_t sampler = 0;
+	uint32_t seed = 0;
+	uint32_t lightSamples = 0;
+	uint32_t ao = 0;
+	float aoRadius = 0.0f;
+	int32_t width = 0;
+	int32_t height = 0;
+
+	bool operator==(const SceneSignature& b) const
+	{
+		return magic == b.magic && version == b.version && key == b.key && nodes == b.nodes && triangles == b.triangles
+			&& samples == b.samples && sampler == b.sampler && seed == b.seed
+			&& lightSamples == b.lightSamples && ao == b.ao && aoRadius == b.aoRadius && width == b.width && height == b.height;
 	}
 };
 
-unsigned int build_nodes(vector<BVHNode>& nodes,
-	vector<Primitive>& primitives,
-	const unsigned int begin,
-	const unsigned int end)
+#ifndef _WIN32
+
+struct BucketMessage
+{
+	int32_t x, y;
+	int32_t width, height;
+};
+
+bool send_all(const int fd, const void *data, size_t size)
 {
-	if (end - begin <= 1)
+	const char *p = (const char *)data;
+	while (size > 0)
 	{
-		// construire une feuille qui reference la primitive d'indice begin, et la boite englobante du triangle associee a la primitive...
-		// renvoyer l'indice de la feuille
-		nodes.push_back(BVHNode(primitives[begin].bounds, -1, -1, primitives[begin].triangleId));
-		return nodes.size() - 1;
+		ssize_t n = send(fd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
 	}
+	return true;
+}
 
-	// Construire la boite englobante des centres des primitives d'indices [begin .. end[
-	AABB b;
-	for (unsigned int i = begin; i < end; i++)
+bool recv_all(const int fd, void *data, size_t size)
+{
+	char *p = (char *)data;
+	while (size > 0)
 	{
-		b.minPoint = min(b.minPoint, primitives[i].center);
-		b.maxPoint = max(b.maxPoint, primitives[i].center);
+		ssize_t n = recv(fd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
 	}
+	return true;
+}
 
-	// Trouver l'axe le plus etire de la boite englobante
-	// Couper en 2 au milieu de boite englobante sur l'axe le plus etire
-	Vector temp(b.maxPoint - b.minPoint);
-	float maxValue = max(max(temp.x, temp.y), temp.z);
-	int axe = (maxValue == temp.x) ? 0 : (maxValue == temp.y) ? 1 : 2;
-	float coupe = (b.minPoint(axe) + b.maxPoint(axe)) / 2.0f;
+// Worker : connects to the coordinator, then renders the buckets it receives until the coordinator closes the connection
+bool run_worker(const string& address, const SceneSignature& signature, const std::function<void(const Tile&, vector<float>&)>& render)
+{
+	size_t colon = address.rfind(':');
+	string host = colon == string::npos ? string("127.0.0.1") : address.substr(0, colon);
+	int port = atoi(address.substr(colon == string::npos ? 0 : colon + 1).c_str());
 
-	// partitionner les primitives par rapport a la "coupe"
-	Primitive* pmid = partition(primitives.data() + begin, primitives.data() + end, predicat(axe, coupe));
-	unsigned int mid = distance(primitives.data(), pmid);
+	sockaddr_in server = {};
+	server.sin_family = AF_INET;
+	server.sin_port = htons((uint16_t)port);
+	if (inet_pton(AF_INET, host.c_str(), &server.sin_addr) != 1)
+	{
+		printf("[error] worker: invalid coordinator address '%s'\n", address.c_str());
+		return false;
+	}
 
-	// verifier que la partition n'est pas degeneree (toutes les primitives du meme cote de la separation)
-	if (mid == begin || mid == end)
-		mid = (begin + end) / 2;
-	assert(mid != begin);
-	assert(mid != end);
-	// remarque : il est possible que 2 (ou plus) primitives aient le meme centre,
-	// dans ce cas, la boite englobante des centres est reduite  un point, et la partition est forcement degeneree
-	// une solution est de construire une feuille,
-	// ou, autre solution, forcer une repartition arbitraire des primitives entre 2 les fils, avec mid= (begin + end) / 2
+	// the coordinator may not listen yet
+	int fd = -1;
+	for (int attempt = 0; attempt < 50 && fd < 0; attempt++)
+	{
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(fd, (const sockaddr *)&server, sizeof(server)) < 0)
+		{
+			close(fd);
+			fd = -1;
+			usleep(100000);
+		}
+	}
+	if (fd < 0)
+	{
+		printf("[error] worker: connecting to '%s'...\n", address.c_str());
+		return false;
+	}
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 
-	// construire le fils gauche 
-	unsigned int left = build_nodes(nodes, primitives, begin, mid);
+	int buckets = 0;
+	bool connected = send_all(fd, &signature, sizeof(signature));
+	BucketMessage message;
+	vector<float> pixels;
+	while (connected && recv_all(fd, &message, sizeof(message)))
+	{
+		Tile bucket = { message.x, message.y, message.width, message.height };
+		pixels.assign((size_t)bucket.width * bucket.height * 3, 0.0f);
+		render(bucket, pixels);
+		connected = send_all(fd, &message, sizeof(message)) && send_all(fd, pixels.data(), pixels.size() * sizeof(float));
+		buckets++;
+	}
+	close(fd);
+	printf("worker: %d buckets\n", buckets);
+	return true;
+}
 
-	// construire le fils droit 
-	unsigned int right = build_nodes(nodes, primitives, mid, end);
+// Coordinator : listens on port, or on any free port of the loopback interface for the local workers only
+int listen_workers(const int port, int& boundPort)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(port > 0 ? INADDR_ANY : INADDR_LOOPBACK);
+	address.sin_port = htons((uint16_t)port);
+	socklen_t length = sizeof(address);
+	if (bind(fd, (const sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 64) < 0
+		|| getsockname(fd, (sockaddr *)&address, &length) < 0)
+	{
+		printf("[error] coordinator: listening on port %d...\n", port);
+		close(fd);
+		return -1;
+	}
+	boundPort = ntohs(address.sin_port);
+	return fd;
+}
 
-	// construire un noeud interne
-	// quelle est sa boite englobante ?
-	AABB nodeBox;
-	nodeBox.minPoint = min(nodes[left].aabb.minPoint, nodes[right].aabb.minPoint);
-	nodeBox.maxPoint = max(nodes[left].aabb.maxPoint, nodes[right].aabb.maxPoint);
-	nodes.push_back(BVHNode(nodeBox, left, right, -1));
+// Starts count local workers, they get the arguments of the coordinator, without the options of the coordinator
+vector<pid_t> start_workers(const int count, const int port, int argc, char **argv)
+{
+	vector<string> args;
+	args.push_back(argv[0]);
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if (option == "-workers" || option == "-port")
+			continue;
+		args.push_back(argv[i]);
+		args.push_back(argv[i + 1]);
+	}
+	args.push_back("-worker");
+	args.push_back("127.0.0.1:" + std::to_string(port));
 
-	// renvoyer l'indice du noeud
-	return nodes.size() - 1;
+	vector<char *> workerArgv;
+	for (size_t i = 0; i < args.size(); i++)
+		workerArgv.push_back(&args[i][0]);
+	workerArgv.push_back(nullptr);
+
+	vector<pid_t> pids;
+	for (int i = 0; i < count; i++)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			execv("/proc/self/exe", workerArgv.data());
+			execvp(workerArgv[0], workerArgv.data());
+			_exit(127);
+		}
+		if (pid > 0)
+			pids.push_back(pid);
+	}
+	return pids;
+}
+
+// The local workers exit when their connection is closed, the workers that do not exit, stopped or lost, are killed
+void stop_workers(const vector<pid_t>& pids)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < pids.size(); i++)
+	{
+		while (waitpid(pids[i], nullptr, WNOHANG) == 0)
+		{
+			if (seconds_since(start) > 2.0)
+			{
+				kill(pids[i], SIGKILL);
+				waitpid(pids[i], nullptr, 0);
+				break;
+			}
+			usleep(10000);
+		}
+	}
 }
 
+struct WorkerConnection
+{
+	int fd;
+	int bucket = -1;		// bucket in progress, -1 : none
+	std::chrono::high_resolution_clock::time_point start;	// of the bucket, or of the connection before the signature
+	bool accepted = false;	// signature received and checked
+
+	// message received by parts without blocking the other workers : the signature, then the result of each bucket
+	vector<char> message;
+	size_t received = 0;
 
-// MAIN
-const unsigned int N = 256;
-int main(int argc, char **argv)
+	WorkerConnection(const int _fd) : fd(_fd), start(std::chrono::high_resolution_clock::now()), message(sizeof(SceneSignature)) {}
+
+	//! lit la suite du message, sans attendre, renvoie false si la connexion est perdue.
+	bool receive()
+	{
+		ssize_t n = recv(fd, message.data() + received, message.size() - received, MSG_DONTWAIT);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0)
+			return false;
+		received += n;
+		return true;
+	}
+
+	bool complete() const { return received == message.size(); }
+
+	//! prepare la reception du message suivant.
+	void expect(const size_t size)
+	{
+		message.resize(size);
+		received = 0;
+	}
+};
+
+// Renders the buckets on the workers, store(bucket, pixels) copies the pixels of a bucket in the image,
+// render(bucket, pixels) renders a bucket in the coordinator.
+bool render_distributed(const int listener, const SceneSignature& signature, const vector<Tile>& buckets, const float timeout,
+	const std::function<void(const Tile&, vector<float>&)>& render, const std::function<void(const Tile&, const vector<float>&)>& store)
 {
-	// init generateur aleatoire
-	srand(time(NULL));
+	std::deque<int> queue;
+	for (int i = 0; i < (int)buckets.size(); i++)
+		queue.push_back(i);
+	vector<bool> done(buckets.size(), false);
+	int remaining = (int)buckets.size();
+	int lost = 0;
+	int local = 0;
+	vector<WorkerConnection> workers;
+	auto lastWorker = std::chrono::high_resolution_clock::now();
+	vector<float> pixels;
+
+	auto drop = [&](const size_t w, const char *reason)
+	{
+		printf("coordinator: worker %d %s\n", workers[w].fd, reason);
+		if (workers[w].bucket >= 0 && done[workers[w].bucket] == false)
+		{
+			queue.push_front(workers[w].bucket);
+			lost++;
+		}
+		close(workers[w].fd);
+		workers.erase(workers.begin() + w);
+	};
+
+	while (remaining > 0)
+	{
+		// give a bucket to the idle workers
+		int accepted = 0;
+		for (size_t w = 0; w < workers.size(); w++)
+			accepted += workers[w].accepted;
+		for (size_t w = 0; w < workers.size() && queue.empty() == false; w++)
+		{
+			if (workers[w].accepted == false || workers[w].bucket >= 0)
+				continue;
+			int b = queue.front();
+			queue.pop_front();
+			BucketMessage message = { buckets[b].x, buckets[b].y, buckets[b].width, buckets[b].height };
+			workers[w].bucket = b;
+			workers[w].start = std::chrono::high_resolution_clock::now();
+			workers[w].expect(sizeof(message) + (size_t)buckets[b].width * buckets[b].height * 3 * sizeof(float));
+			if (send_all(workers[w].fd, &message, sizeof(message)) == false)
+			{
+				drop(w, "lost");
+				w--;
+			}
+		}
+
+		// no worker for a while : render a bucket here
+		if (accepted == 0 && queue.empty() == false && seconds_since(lastWorker) > WORKER_WAIT)
+		{
+			int b = queue.front();
+			queue.pop_front();
+			pixels.assign((size_t)buckets[b].width * buckets[b].height * 3, 0.0f);
+			render(buckets[b], pixels);
+			store(buckets[b], pixels);
+			done[b] = true;
+			remaining--;
+			local++;
+			continue;
+		}
+
+		vector<pollfd> fds(1 + workers.size());
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (size_t w = 0; w < workers.size(); w++)
+		{
+			fds[1 + w].fd = workers[w].fd;
+			fds[1 + w].events = POLLIN;
+		}
+		if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+		{
+			printf("[error] coordinator: poll...\n");
+			return false;
+		}
+
+		// signatures and results of the workers, or lost connections, in reverse order to drop workers safely
+		for (int w = (int)workers.size() - 1; w >= 0; w--)
+		{
+			WorkerConnection& worker = workers[w];
+			if (fds[1 + w].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				// an idle worker does not send anything
+				if ((worker.accepted && worker.bucket < 0) || worker.receive() == false)
+				{
+					drop(w, "lost");
+					continue;
+				}
+
+				if (worker.complete() && worker.accepted == false)
+				{
+					// signature of a new worker, checked against the scene and the options of the coordinator
+					SceneSignature workerSignature;
+					memcpy(&workerSignature, worker.message.data(), sizeof(workerSignature));
+					if ((workerSignature == signature) == false)
+					{
+						drop(w, "refused, its scene, its render options or its BVH are not the same");
+						continue;
+					}
+					worker.accepted = true;
+					worker.expect(0);
+					lastWorker = std::chrono::high_resolution_clock::now();
+					continue;
+				}
+
+				if (worker.complete())
+				{
+					int b = worker.bucket;
+					const Tile& bucket = buckets[b];
+					BucketMessage message;
+					memcpy(&message, worker.message.data(), sizeof(message));
+					if (message.x != bucket.x || message.y != bucket.y || message.width != bucket.width || message.height != bucket.height)
+					{
+						drop(w, "lost");
+						continue;
+					}
+					pixels.resize((size_t)bucket.width * bucket.height * 3);
+					memcpy(pixels.data(), worker.message.data() + sizeof(message), pixels.size() * sizeof(float));
+					if (done[b] == false)
+					{
+						store(bucket, pixels);
+						done[b] = true;
+						remaining--;
+					}
+					worker.bucket = -1;
+					worker.expect(0);
+					lastWorker = std::chrono::high_resolution_clock::now();
+					continue;
+				}
+			}
+
+			// the signature or the result of a bucket is late, a worker that stops in the middle of a message is lost too
+			if ((worker.accepted == false || worker.bucket >= 0) && timeout > 0.0f && seconds_since(worker.start) > timeout)
+				drop(w, "timed out");
+		}
+
+		// new workers, their signature is read by the next polls
+		if (fds[0].revents & POLLIN)
+		{
+			int fd = accept(listener, nullptr, nullptr);
+			if (fd >= 0)
+			{
+				int yes = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+				workers.push_back(WorkerConnection(fd));
+			}
+		}
+	}
+
+	// the workers exit when their connection is closed
+	int connected = 0;
+	for (size_t w = 0; w < workers.size(); w++)
+	{
+		connected += workers[w].accepted;
+		close(workers[w].fd);
+	}
+	printf("coordinator: %d buckets, %d lost and rendered again, %d rendered by the coordinator, %d workers connected at the end\n",
+		(int)buckets.size(), lost, local, connected);
+	return true;
+}
+#endif
 
-	// lire un maillage et ses matieres	
-	Mesh mesh = read_mesh("m2tp/TutoRayTrace/cornell.obj");
-	if (mesh == Mesh::error())
+// ray_bench.cpp includes this file without its main()
+#ifndef RAY_TUTO_NO_MAIN
+int main(int argc, char **argv)
+{
+	RenderOptions options;
+	if (parse_options(argc, argv, options) == false)
 		return 1;
 
-	// extraire les sources
-	build_sources(mesh);
-	// extraire les triangles du maillage
-	build_triangles(mesh);
-	// Build the scene's BVH
-	rootNodeId = build_nodes(bvh, primitives, 0, primitives.size());
+	// occultation ambiante, la table des directions est construite pour le nombre max d'echantillons
+	aoMode = options.ao;
+	aoRadius = options.aoRadius;
+	aoCacheError = options.aoCacheError;
+	if (aoMode == AO_CACHE && options.progressive)
+	{
+		printf("[error] the ambient occlusion cache can not be used by the progressive mode\n");
+		return 1;
+	}
+	if (aoMode == AO_CACHE && options.threads != 1)
+		// the records depend on the order the threads render the pixels
+		printf("[warning] the ambient occlusion cache is shared by the threads, the render changes between runs with the same seed\n");
+	if (options.stream && (options.progressive || options.wavefront || options.denoiseLevels > 0))
+	{
+		printf("[error] the progressive mode, the wavefront render and the denoiser need the whole image, it can not be streamed\n");
+		return 1;
+	}
+	bool distributed = options.workers > 0 || options.port > 0 || options.worker.empty() == false;
+	if (distributed && (options.progressive || options.wavefront || options.stream || options.denoiseLevels > 0 || options.frames > 1
+		|| aoMode == AO_CACHE))
+	{
+		// the ambient occlusion cache of each process depends on the buckets it rendered before
+		printf("[error] the distributed render draws one frame, without the progressive mode, the wavefront render, the stream, the denoiser or the ambient occlusion cache\n");
+		return 1;
+	}
+#ifdef _WIN32
+	if (distributed)
+	{
+		printf("[error] the distributed render is not available on windows\n");
+		return 1;
+	}
+#endif
+	if (options.wavefront && (options.progressive || aoMode == AO_CACHE))
+	{
+		printf("[error] the wavefront render can not be used by the progressive mode or the ambient occlusion cache\n");
+		return 1;
+	}
+	if (aoMode == AO_COSINE)
+		build_ao_directions(options.samples);
 
-	// relire une camera
+	Mesh mesh;
 	Orbiter camera;
-	camera.lookat(Point(0, 1, 0), 4.0f);
-	//camera.read_orbiter("m2tp/TutoRayTrace/orbiter.txt");
+	float lightRadius = 20.0f;
+	SceneSignature signature;
+	signature.samples = options.samples;
+	signature.sampler = options.sampler;
+	signature.seed = options.seed;
+	signature.lightSamples = options.lightSamples;
+	signature.ao = aoMode;
+	signature.aoRadius = aoRadius;
+	signature.width = options.width;
+	signature.height = options.height;
+	if (options.instances.empty() == false)
+	{
+		// lire les maillages et leurs instances, un BVH par maillage et un BVH des instances
+		if (read_instances(options.instances.c_str(), bvhBuilder, bvhLeafSize) == false)
+			return 1;
+		if (options.animatedMaterial >= 0)
+		{
+			printf("[error] the instances can not be animated\n");
+			return 1;
+		}
+		build_instances(bvhBuilder);
+		build_light_tree(lightTree, sources);
+		traversal = TRAVERSAL_INSTANCES;
+
+		signature.key = distributed ? bvh_cache_key(options.instances.c_str(), bvhBuilder, bvhLeafSize) : 0;
+		signature.nodes = instanceBVH.size();
+		signature.triangles = 0;
+		for (size_t i = 0; i < meshBVHs.size(); i++)
+		{
+			if (distributed)
+			{
+				uint64_t meshKey = bvh_cache_key(meshBVHs[i].filename.c_str(), bvhBuilder, bvhLeafSize);
+				signature.key = hash_bytes((const unsigned char *)&meshKey, sizeof(meshKey), signature.key);
+			}
+			signature.nodes += meshBVHs[i].nodes.size();
+			signature.triangles += meshBVHs[i].triangles.size();
+		}
+
+		// cadrer toute la scene
+		const AABB& bounds = instanceBVH[0].aabb;
+		float size = length(Vector(bounds.minPoint, bounds.maxPoint));
+		camera.lookat(bounds.center(), size);
+		lightRadius = std::max(lightRadius, 4.0f * size);
+	}
+	else
+	{
+		// lire un maillage et ses matieres	
+		const char *sceneFile = "m2tp/TutoRayTrace/cornell.obj";
+		mesh = read_mesh(sceneFile);
+		if (mesh == Mesh::error())
+			return 1;
+
+		// extraire les sources
+		build_sources(mesh);
+		build_light_tree(lightTree, sources);
+
+		// relire les triangles et le BVH depuis le cache, ou les construire
+		uint64_t sceneKey = options.cache || distributed ? bvh_cache_key(sceneFile, bvhBuilder, bvhLeafSize) : 0;
+		uint64_t cacheKey = options.cache ? sceneKey : 0;
+		string cacheFile = bvh_cache_filename(sceneFile, cacheKey);
+		if (cacheKey == 0 || load_bvh_cache(cacheFile.c_str(), cacheKey) == false)
+		{
+			// extraire les triangles du maillage
+			build_triangles(mesh);
+			// Build the scene's BVH
+			rootNodeId = build_bvh(bvh, triangles, primitives, bvhBuilder, bvhLeafSize);
+			bvhBuildCost = bvh_sah_cost(bvh);
+			if (cacheKey != 0)
+				save_bvh_cache(cacheFile.c_str(), cacheKey);
+		}
+		if (bvhTraversal == TRAVERSAL_QBVH)
+			build_qbvh(qbvh, bvh);
+		if (bvhTraversal == TRAVERSAL_QBVH_COMPRESSED)
+			build_compressed_qbvh(compressedQbvh, bvh);
+		build_triangle_soa(triangleSoA, triangles);
+		traversal = bvhTraversal;
+
+		signature.key = sceneKey;
+		signature.nodes = bvh.size();
+		signature.triangles = triangles.size();
+
+		// relire une camera
+		camera.lookat(Point(0, 1, 0), 4.0f);
+		//camera.read_orbiter("m2tp/TutoRayTrace/orbiter.txt");
+	}
 
 	// placer une source de lumiere
 	Point light = camera.position();
 	//Point light = Point(0.0f, 1.7f, 0.0f);
-	float lightRadius = 20.0f;
 	float lightIntensity = 2.0f;
 	float fieldOfView = 60.0f;
+	PointLight pointLight = { light, lightRadius, lightIntensity };
+
+	// multi thread, sur des blocs de PACKET_SIZE x PACKET_SIZE pixels regroupes en tuiles
+	ThreadPool pool(options.threads);
+	TileScheduler scheduler(pool, options.tileSize, options.tileOrder);
 
-	// creer l'image pour stocker le resultat
-	Image image(512, 512);
+#ifndef _WIN32
+	// rendu distribue : ecouter les workers et demarrer les workers locaux, apres l'ecriture du cache du BVH
+	int listener = -1;
+	vector<pid_t> workerPids;
+	if (distributed)
+		signal(SIGPIPE, SIG_IGN);
+	if (options.workers > 0 || options.port > 0)
+	{
+		int port = 0;
+		listener = listen_workers(options.port, port);
+		if (listener < 0)
+			return 1;
+		printf("coordinator: port %d\n", port);
+		workerPids = start_workers(options.workers, port, argc, argv);
+	}
+#endif
 
-	// multi thread avec OpenMP
-#pragma omp parallel for schedule(dynamic, 16)
-	for (int y = 0; y < image.height(); y++)
+	for (int frame = 0; frame < options.frames; frame++)
 	{
-		for (int x = 0; x < image.width(); x++)
+		// animer la scene, le BVH est mis a jour par un refit
+		if (frame > 0 && options.animatedMaterial >= 0)
+			animate_triangles(mesh, options.animatedMaterial, frame * animationStep, bvhBuilder, bvhLeafSize);
+
+		// creer l'image pour stocker le resultat, ou seulement une bande de lignes quand l'image est ecrite pendant le rendu
+		const int width = options.width;
+		const int height = options.height;
+		const int bandHeight = std::max(options.tileSize / PACKET_SIZE, 1) * PACKET_SIZE;
+		Image image(width, options.stream ? std::min(bandHeight, height) : height);
+		int imageX = 0, imageY = 0;	// position de image dans l'image complete
+		std::unique_ptr<ImageStream> stream;
+		if (options.stream)
+			stream.reset(new ImageStream(render_filename("hdr", options.frames > 1 ? frame : -1).c_str(),
+				render_filename("png", options.frames > 1 ? frame : -1).c_str(), width, height));
+		if (stream && stream->is_open() == false)
+			return 1;
+		if (stream && (size_t)width * height * 3 > ((size_t)64 << 20))
+			printf("[warning] the streamed png is not compressed, %dMB, the hdr file is the output of the large renders\n",
+				(int)((size_t)width * height * 3 >> 20));
+
+		Point dO;
+		Vector dx, dy;
+		camera.frame(width, height, 1.0f, fieldOfView, dO, dx, dy);
+		Point o = camera.position();
+
+#ifdef RAY_STATS
+		pixelStats.assign(width * height, RayStats());
+#endif
+
+		// buffers auxiliaires du debruitage
+		Image albedoBuffer, normalBuffer, depthBuffer;
+		if (options.denoiseLevels > 0)
+		{
+			albedoBuffer = Image(width, height);
+			normalBuffer = Image(width, height);
+			depthBuffer = Image(width, height);
+		}
+
+		// cache de l'occultation ambiante, reconstruit a chaque image, la scene peut bouger
+		const AABB& bounds = traversal == TRAVERSAL_INSTANCES ? instanceBVH[0].aabb : bvh[rootNodeId].aabb;
+		std::unique_ptr<AOCache> cache;
+		if (aoMode == AO_CACHE)
+		{
+			float size = length(Vector(bounds.minPoint, bounds.maxPoint));
+			cache.reset(new AOCache(bounds, aoRadius > 0.0f ? std::min(aoRadius, size) : size / 4.0f));
+			aoCache = cache.get();
+		}
+
+		// estimations des pixels du rendu progressif
+		vector<PixelEstimate> estimates;
+		if (options.progressive)
+			estimates.resize(width * height);
+
+		// rendu d'un bloc de PACKET_SIZE x PACKET_SIZE pixels, le pixel x, y est le pixel x - imageX, y - imageY de image
+		auto renderBlock = [&](const Tile& block, const int thread)
+		{
+			// Primary rays of the block
+			RayPacket packet;
+			int pixels[PACKET_RAYS][2];
+			for (int y = block.y; y < block.y + block.height; y++)
+			{
+				for (int x = block.x; x < block.x + block.width; x++)
+				{
+					pixels[packet.count][0] = x;
+					pixels[packet.count][1] = y;
+					Point e = dO + x * dx + y * dy;
+					packet.add(Ray(o, e));
+				}
+			}
+
+			Hit hits[PACKET_RAYS];
+			RAY_STAT(rayStats = RayStats());
+			// the packets are traced in the BVH of the scene mesh, the instances are traced ray by ray
+			if (usePackets && traversal != TRAVERSAL_INSTANCES)
+				intersect_packet(packet, hits);
+			else
+			{
+				for (int i = 0; i < packet.count; i++)
+				{
+					hits[i].t = packet.rays[i].tmax;
+					intersect_scene(packet.rays[i], hits[i]);
+				}
+			}
+
+			// the cost of the primary rays is shared by the pixels of the block
+			RAY_STAT(RayStats primaryStats = rayStats.share(packet.count));
+
+			for (int i = 0; i < packet.count; i++)
+			{
+				int x = pixels[i][0];
+				int y = pixels[i][1];
+				Hit& hit = hits[i];
+				RAY_STAT(rayStats = primaryStats);
+				if (hit.object_id != -1)
+				{
+					Color albedo;
+					Color direct = GetDirectLighting(hit, x, y, mesh, options, pointLight, albedo);
+					if (options.denoiseLevels > 0)
+						write_guides(albedoBuffer, normalBuffer, depthBuffer, x, y, o, hit, albedo);
+
+					Sampler sampler(options.sampler, x, y, options.seed);
+					if (options.progressive)
+					{
+						// the ambient occlusion is estimated by render_progressive
+						estimates[y * width + x] = PixelEstimate(hit, direct, sampler);
+						RAY_STAT(pixelStats[y * width + x] = rayStats);
+						continue;
+					}
+
+					// Compute ambient occlusion factor
+					float ambientTerm = GetAmbientOcclusionTerm(hit, options.samples, sampler);
+
+					// Render result
+					image(x - imageX, y - imageY) = Color(direct * ambientTerm, 1);
+					//image(x - imageX, y - imageY) = Color(ambientTerm, ambientTerm, ambientTerm, 1);
+				}
+				RAY_STAT(pixelStats[y * width + x] = rayStats);
+			}
+		};
+
+		if (options.wavefront)
+			render_wavefront(image, o, dO, dx, dy, mesh, pointLight, pool, options, bounds, albedoBuffer, normalBuffer, depthBuffer);
+		else if (stream)
+		{
+			// les bandes de lignes, du haut de l'image vers le bas, sont encodees pendant le rendu des suivantes
+			for (int top = height; top > 0; top -= bandHeight)
+			{
+				imageY = std::max(top - bandHeight, 0);
+				int rows = top - imageY;
+				image = Image(width, rows);
+				scheduler.run(width, rows, PACKET_SIZE, [&](const Tile& cell, const int thread)
+				{
+					Tile block = cell;
+					block.y += imageY;
+					renderBlock(block, thread);
+				});
+
+				vector<float> band((size_t)width * rows * 3);
+				for (int y = 0; y < rows; y++)
+				{
+					for (int x = 0; x < width; x++)
+					{
+						Color c = image(x, rows - 1 - y);
+						float *pixel = &band[((size_t)y * width + x) * 3];
+						pixel[0] = c.r;
+						pixel[1] = c.g;
+						pixel[2] = c.b;
+					}
+				}
+				stream->push(std::move(band));
+			}
+			if (stream->close() == false)
+				printf("[error] writing the render...\n");
+		}
+#ifndef _WIN32
+		else if (options.worker.empty() == false || listener >= 0)
 		{
-			Point dO;
-			Vector dx, dy;
-			camera.frame(image.width(), image.height(), 1.0f, fieldOfView, dO, dx, dy);
-			Point o = camera.position();
-			Point e = dO + x * dx + y * dy;
-			Ray ray(o, e);
-			Hit hit;
-			hit.t = ray.tmax;
-			if (intersect(ray, hit, rootNodeId) == true)
+			// rendu d'un bucket, par un worker ou par le coordinateur
+			auto renderBucket = [&](const Tile& bucket, vector<float>& pixels)
+			{
+				image = Image(bucket.width, bucket.height);
+				imageX = bucket.x;
+				imageY = bucket.y;
+				scheduler.run(bucket.width, bucket.height, PACKET_SIZE, [&](const Tile& cell, const int thread)
+				{
+					Tile block = cell;
+					block.x += imageX;
+					block.y += imageY;
+					renderBlock(block, thread);
+				});
+				for (int y = 0; y < bucket.height; y++)
+				{
+					for (int x = 0; x < bucket.width; x++)
+					{
+						Color c = image(x, y);
+						float *pixel = &pixels[((size_t)y * bucket.width + x) * 3];
+						pixel[0] = c.r;
+						pixel[1] = c.g;
+						pixel[2] = c.b;
+					}
+				}
+			};
+
+			if (options.worker.empty() == false)
+				return run_worker(options.worker, signature, renderBucket) ? 0 : 1;
+
+			int bucketSize = std::max(options.bucketSize / PACKET_SIZE, 1) * PACKET_SIZE;
+			vector<Tile> buckets;
+			for (int y = 0; y < height; y += bucketSize)
 			{
-				// calculer l'eclairage direct pour chaque source
-				Vector lightDir = normalize(hit.p - light);
-				float diffuseTerm = std::max(dot(-lightDir, hit.n), 0.0f)
-					* (1.0f - (length(hit.p - light) / lightRadius))
-					* lightIntensity;
+				for (int x = 0; x < width; x += bucketSize)
+				{
+					Tile bucket = { x, y, std::min(bucketSize, width - x), std::min(bucketSize, height - y) };
+					buckets.push_back(bucket);
+				}
+			}
+
+			Image result(width, height);
+			render_distributed(listener, signature, buckets, options.workerTimeout, renderBucket,
+				[&](const Tile& bucket, const vector<float>& pixels)
+				{
+					for (int y = 0; y < bucket.height; y++)
+					{
+						for (int x = 0; x < bucket.width; x++)
+						{
+							const float *pixel = &pixels[((size_t)y * bucket.width + x) * 3];
+							result(bucket.x + x, bucket.y + y) = Color(pixel[0], pixel[1], pixel[2], 1);
+						}
+					}
+				});
+			image = result;
+			imageX = 0;
+			imageY = 0;
+
+			close(listener);
+			stop_workers(workerPids);
+		}
+#endif
+		else
+			scheduler.run(width, height, PACKET_SIZE, renderBlock);
+
+		if (options.progressive)
+			render_progressive(image, estimates, scheduler, options);
+
+		if (cache)
+		{
+			printf("ao cache: %d records, %d lookups, %.1f%% interpolated, %.2f ao rays per pixel\n",
+				cache->records(), cache->lookups(), 100.0f * cache->hits() / std::max(cache->lookups(), 1),
+				cache->records() * (float)options.samples / std::max(cache->lookups(), 1));
+			aoCache = nullptr;
+		}
 
-				// Compute ambient occlusion factor
-				float ambientTerm = GetAmbientOcclusionTerm(hit, N);
+		if (stream == nullptr)
+			write_render(image, options.frames > 1 ? frame : -1);
+
+		if (options.denoiseLevels > 0)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			Denoiser denoiser(image.width(), image.height(), options.denoiseLevels);
+			for (int y = 0; y < image.height(); y++)
+			{
+				for (int x = 0; x < image.width(); x++)
+				{
+					Color a = albedoBuffer(x, y);
+					Color n = normalBuffer(x, y);
+					Color c = image(x, y);
+					float albedo[3] = { a.r, a.g, a.b };
+					float normal[3] = { n.r, n.g, n.b };
+					float color[3] = { c.r, c.g, c.b };
+					denoiser.guides(x, y, albedo, normal, depthBuffer(x, y).r);
+					denoiser.color(x, y, color);
+				}
+			}
+			denoiser.run(pool, options.denoiseStrength);
 
-				// Render result
-				Color direct = hitColor(mesh, hit) * diffuseTerm * ambientTerm;
-				image(x, y) = Color(direct, 1);
-				//image(x, y) = Color(ambientTerm, ambientTerm, ambientTerm, 1);
+			Image denoised(image.width(), image.height());
+			for (int y = 0; y < image.height(); y++)
+			{
+				for (int x = 0; x < image.width(); x++)
+				{
+					float color[3];
+					denoiser.result(x, y, color);
+					denoised(x, y) = Color(color[0], color[1], color[2], 1);
+					// the normals are stored in [0 1] in the png
+					normalBuffer(x, y) = Color(normalBuffer(x, y) * 0.5f + Color(0.5f), 1);
+				}
 			}
+			int elapsed = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+			printf("denoised, %d levels, %dms.\n", denoiser.levels(), elapsed);
+			write_denoised(denoised, albedoBuffer, normalBuffer, depthBuffer, options.frames > 1 ? frame : -1);
 		}
+		RAY_STAT(write_stats(width, height, options.frames > 1 ? frame : -1));
 	}
-
-	write_image(image, "m2tp/TutoRayTrace/render.png");
-	write_image_hdr(image, "m2tp/TutoRayTrace/render.hdr");
 	return 0;
 }
+#endif